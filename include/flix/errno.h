@@ -0,0 +1,7 @@
+#ifndef FLIX_ERRNO_H
+#define FLIX_ERRNO_H
+
+#define ENOMEM 12
+#define EINVAL 22
+
+#endif /* FLIX_ERRNO_H */
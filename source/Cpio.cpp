@@ -1,4 +1,5 @@
 #include "Cpio.hpp"
+#include "ObjectCache.hpp"
 #include "Debug.hpp"
 #include <flix/stat.h>
 
@@ -6,7 +7,8 @@ XLL_LOG_CATEGORY("core/vfs/cpio");
 
 class CpioFileInode;
 
-class CpioFileHandle : public fs::Handle
+class CpioFileHandle : public fs::Handle,
+                       public CachedAllocation<CpioFileHandle>
 {
 public:
   explicit CpioFileHandle(std::shared_ptr<CpioFileInode> inode)
@@ -93,7 +95,8 @@ class CpioFs : public fs::SuperBlock
 {
 public:
   CpioFs()
-    : _root(std::make_shared<CpioFolderInode>())
+    : _root(std::allocate_shared<CpioFolderInode>(
+          CacheAllocator<CpioFolderInode>()))
   {
   }
 
@@ -131,7 +134,8 @@ public:
         else
         {
           xDeb("Creating inode %s", name);
-          auto newFolder = std::make_shared<CpioFolderInode>();
+          auto newFolder = std::allocate_shared<CpioFolderInode>(
+              CacheAllocator<CpioFolderInode>());
           newFolder->_name = name;
           newFolder->i_mode = S_IFDIR;
           curInode->_children.push_back(newFolder);
@@ -146,7 +150,8 @@ public:
 
     assert(start < path);
 
-    auto finalInode = std::make_shared<CpioFileInode>();
+    auto finalInode = std::allocate_shared<CpioFileInode>(
+        CacheAllocator<CpioFileInode>());
     finalInode->_name = std::string(start, path);
     xDeb("Final inode %s", finalInode->_name);
     curInode->_children.push_back(finalInode);
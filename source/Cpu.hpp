@@ -12,6 +12,71 @@ static constexpr uint32_t MSR_LSTAR = 0xC0000082;
 
 uint64_t rflags();
 
+/// Read the time stamp counter
+inline uint64_t rdtsc()
+{
+  uint32_t low, high;
+  asm volatile ("rdtsc" : "=a"(low), "=d"(high));
+  return static_cast<uint64_t>(high) << 32 | low;
+}
+
+inline void cpuid(uint32_t leaf,
+    uint32_t& eax, uint32_t& ebx, uint32_t& ecx, uint32_t& edx)
+{
+  asm volatile ("cpuid"
+      :"=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx)
+      :"a"(leaf), "c"(0)
+     );
+}
+
+/// Tell if the CPU can map 1GB pages at the page directory pointer level
+inline bool has1GbPages()
+{
+  uint32_t eax, ebx, ecx, edx;
+  cpuid(0x80000000, eax, ebx, ecx, edx);
+  if (eax < 0x80000001)
+    return false;
+  cpuid(0x80000001, eax, ebx, ecx, edx);
+  return edx & (1 << 26);
+}
+
+/// Tell if the CPU supports process-context identifiers
+inline bool hasPcid()
+{
+  uint32_t eax, ebx, ecx, edx;
+  cpuid(1, eax, ebx, ecx, edx);
+  return ecx & (1 << 17);
+}
+
+/// Tell if the CPU supports the invpcid instruction
+inline bool hasInvpcid()
+{
+  uint32_t eax, ebx, ecx, edx;
+  cpuid(0, eax, ebx, ecx, edx);
+  if (eax < 7)
+    return false;
+  cpuid(7, eax, ebx, ecx, edx);
+  return ebx & (1 << 10);
+}
+
+static constexpr uint64_t INVPCID_ADDRESS = 0;
+static constexpr uint64_t INVPCID_CONTEXT = 1;
+static constexpr uint64_t INVPCID_ALL = 2;
+
+/// Invalidate TLB entries, \p type is one of the INVPCID_* constants
+inline void invpcid(uint64_t type, uint16_t pcid, const void* address = nullptr)
+{
+  struct
+  {
+    uint64_t pcid;
+    const void* address;
+  } descriptor = {pcid, address};
+  asm volatile ("invpcid %0, %1"
+      :
+      :"m"(descriptor), "r"(type)
+      :"memory");
+}
+
 inline void writeMsr(uint32_t msr, uint64_t value)
 {
   asm volatile ("wrmsr"
@@ -46,6 +111,45 @@ inline void enableSSEInstructions()
       :"rax");
 }
 
+/// Set CR4.PCIDE, the PCID of the current CR3 must be 0
+inline void enablePcid()
+{
+  asm volatile (
+      "mov %%cr4, %%rax\n"
+      "btsq $17, %%rax\n"
+      "mov %%rax, %%cr4\n"
+      :
+      :
+      :"rax", "memory");
+}
+
+/// Set CR4.PGE, global pages are kept in the TLB when CR3 is reloaded
+inline void enableGlobalPages()
+{
+  asm volatile (
+      "mov %%cr4, %%rax\n"
+      "btsq $7, %%rax\n"
+      "mov %%rax, %%cr4\n"
+      :
+      :
+      :"rax", "memory");
+}
+
+/// Invalidate all TLB entries of all PCIDs, including global ones
+inline void flushAllContexts()
+{
+  // any change to CR4.PGE flushes everything
+  asm volatile (
+      "mov %%cr4, %%rax\n"
+      "btcq $7, %%rax\n"
+      "mov %%rax, %%cr4\n"
+      "btcq $7, %%rax\n"
+      "mov %%rax, %%cr4\n"
+      :
+      :
+      :"rax", "memory");
+}
+
 void setKernelStack(void* stack);
 
 }
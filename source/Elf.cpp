@@ -58,14 +58,10 @@ bool exec(fs::Handle& f, const std::vector<std::string>& args)
 
     xDeb("Mapping segment in memory at %x of size %x",
         prgHdr.p_vaddr, prgHdr.p_memsz);
-    for (auto cur = prgHdr.p_vaddr, end = cur + prgHdr.p_memsz;
-        cur < end;
-        cur += PAGE_SIZE)
-      pd.mapPage(reinterpret_cast<char*>(cur),
-          PageDirectory::ATTR_RW | PageDirectory::ATTR_PUBLIC);
-
-    xDeb("Zeroing");
-    std::memset(reinterpret_cast<char*>(prgHdr.p_vaddr), 0, prgHdr.p_memsz);
+    pd.mapRange(reinterpret_cast<char*>(prgHdr.p_vaddr),
+        reinterpret_cast<char*>(prgHdr.p_vaddr + prgHdr.p_memsz),
+        PageDirectory::ATTR_RW | PageDirectory::ATTR_PUBLIC |
+        PageDirectory::ATTR_ZERO);
 
     xDeb("Loading segment in file at %x of size %x",
         prgHdr.p_offset, prgHdr.p_filesz);
@@ -80,7 +76,8 @@ bool exec(fs::Handle& f, const std::vector<std::string>& args)
   xDeb("Allocating new stack");
   pd.mapRange(reinterpret_cast<void*>(0x000000f000000000),
       reinterpret_cast<void*>(0x000000f000004000),
-      PageDirectory::ATTR_RW | PageDirectory::ATTR_PUBLIC);
+      PageDirectory::ATTR_RW | PageDirectory::ATTR_PUBLIC |
+      PageDirectory::ATTR_ZERO);
 
   xDeb("Pushing arguments on stack");
   // TODO check size for overflow
@@ -0,0 +1,138 @@
+#include "HierarchicalBitmap.hpp"
+#include <algorithm>
+
+void HierarchicalBitmap::init(std::size_t bitCount)
+{
+  assert(!m_levelCount && "Bitmap initialized twice");
+
+  m_bitCount = bitCount;
+
+  std::size_t count = bitCount;
+  do
+  {
+    if (m_levelCount == MaxLevelCount)
+      PANIC("Bitmap too large");
+
+    count = (count + BitsPerWord - 1) / BitsPerWord;
+    m_levels[m_levelCount++].resize(count, 0);
+  } while (count > 1);
+}
+
+void HierarchicalBitmap::setFrom(unsigned level, std::size_t bit)
+{
+  for (; level < m_levelCount; ++level)
+  {
+    uint64_t& word = m_levels[level][bit / BitsPerWord];
+    const bool wasEmpty = !word;
+    word |= 1ull << bit % BitsPerWord;
+    // upper levels already know this word is not empty
+    if (!wasEmpty)
+      return;
+    bit /= BitsPerWord;
+  }
+}
+
+void HierarchicalBitmap::clearFrom(unsigned level, std::size_t bit)
+{
+  for (; level < m_levelCount; ++level)
+  {
+    uint64_t& word = m_levels[level][bit / BitsPerWord];
+    word &= ~(1ull << bit % BitsPerWord);
+    // upper levels must only be updated when the word becomes empty
+    if (word)
+      return;
+    bit /= BitsPerWord;
+  }
+}
+
+std::size_t HierarchicalBitmap::assignRange(std::size_t from, std::size_t to,
+    bool value)
+{
+  assert(from <= to && to <= m_bitCount);
+
+  std::size_t changed = 0;
+  while (from < to)
+  {
+    const std::size_t index = from / BitsPerWord;
+    const std::size_t end = std::min(to, (index + 1) * BitsPerWord);
+    const std::size_t count = end - from;
+    const uint64_t mask = (count == BitsPerWord ? ~0ull : (1ull << count) - 1)
+      << from % BitsPerWord;
+
+    uint64_t& word = m_levels[0][index];
+    const uint64_t old = word;
+    if (value)
+      word |= mask;
+    else
+      word &= ~mask;
+    changed += __builtin_popcountll(old ^ word);
+
+    // only a word becoming empty or not empty changes the upper levels
+    if (!old && word)
+      setFrom(1, index);
+    else if (old && !word)
+      clearFrom(1, index);
+
+    from = end;
+  }
+
+  return changed;
+}
+
+std::size_t HierarchicalBitmap::findNextSet(std::size_t from) const
+{
+  if (from >= m_bitCount)
+    return npos;
+
+  // go up until a word has a set bit at or after our position
+  std::size_t index = from;
+  unsigned level = 0;
+  while (true)
+  {
+    const std::size_t word = index / BitsPerWord;
+    if (word < m_levels[level].size())
+    {
+      const uint64_t bits =
+        m_levels[level][word] & (~0ull << index % BitsPerWord);
+      if (bits)
+      {
+        index = word * BitsPerWord + __builtin_ctzll(bits);
+        break;
+      }
+    }
+
+    if (++level == m_levelCount)
+      return npos;
+    // the bit of the next word in the upper level
+    index = word + 1;
+  }
+
+  // then go down taking the lowest set bit
+  while (level-- > 0)
+  {
+    const uint64_t word = m_levels[level][index];
+    assert(word && "Summary bit set for an empty word");
+    index = index * BitsPerWord + __builtin_ctzll(word);
+  }
+
+  assert(index < m_bitCount);
+  return index;
+}
+
+std::size_t HierarchicalBitmap::findNextClear(std::size_t from,
+    std::size_t to) const
+{
+  assert(from <= to && to <= m_bitCount);
+
+  while (from < to)
+  {
+    const uint64_t clear =
+      ~m_levels[0][from / BitsPerWord] & (~0ull << from % BitsPerWord);
+    if (clear)
+      return std::min(to, from / BitsPerWord * BitsPerWord +
+          __builtin_ctzll(clear));
+    from = (from / BitsPerWord + 1) * BitsPerWord;
+  }
+
+  return to;
+}
@@ -0,0 +1,86 @@
+#ifndef HIERARCHICAL_BITMAP_HPP
+#define HIERARCHICAL_BITMAP_HPP
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+#include "Debug.hpp"
+
+/**
+ * Bitmap with summary levels to find a set bit in O(log64(n))
+ *
+ * Level 0 holds the bits themselves. In each upper level, a bit is set when
+ * the corresponding word of the level below is not zero. Looking for a set
+ * bit goes down from the top level with one tzcnt per level.
+ *
+ * The storage is allocated once in init() and never resized.
+ */
+class HierarchicalBitmap
+{
+public:
+  static constexpr std::size_t npos = ~static_cast<std::size_t>(0);
+
+  HierarchicalBitmap() = default;
+  HierarchicalBitmap(const HierarchicalBitmap&) = delete;
+  HierarchicalBitmap& operator=(const HierarchicalBitmap&) = delete;
+
+  /// Allocate the storage for \p bitCount bits, all cleared
+  void init(std::size_t bitCount);
+
+  std::size_t size() const
+  {
+    return m_bitCount;
+  }
+
+  bool test(std::size_t bit) const
+  {
+    return m_levels[0][bit / BitsPerWord] & (1ull << bit % BitsPerWord);
+  }
+  void set(std::size_t bit)
+  {
+    assert(bit < m_bitCount);
+    setFrom(0, bit);
+  }
+  void clear(std::size_t bit)
+  {
+    assert(bit < m_bitCount);
+    clearFrom(0, bit);
+  }
+  /** Set or clear the bits in [\p from, \p to) a word at a time
+   *
+   * \return the number of bits that changed
+   */
+  std::size_t assignRange(std::size_t from, std::size_t to, bool value);
+
+  /// Get the lowest set bit, npos if there is none
+  std::size_t findFirstSet() const
+  {
+    return findNextSet(0);
+  }
+  /// Get the lowest set bit at or after \p from, npos if there is none
+  std::size_t findNextSet(std::size_t from) const;
+  /** Get the lowest cleared bit in [\p from, \p to)
+   *
+   * Only level 0 is looked at, so this is linear in the size of the range.
+   *
+   * \return \p to if all bits of the range are set
+   */
+  std::size_t findNextClear(std::size_t from, std::size_t to) const;
+
+private:
+  static constexpr std::size_t BitsPerWord = 64;
+  static constexpr unsigned MaxLevelCount = 4;
+
+  std::size_t m_bitCount = 0;
+  unsigned m_levelCount = 0;
+  /// Level 0 is the bitmap itself, the last level fits in one word
+  std::vector<uint64_t> m_levels[MaxLevelCount];
+
+  /// Set \p bit of \p level and update the levels above
+  void setFrom(unsigned level, std::size_t bit);
+  /// Clear \p bit of \p level and update the levels above
+  void clearFrom(unsigned level, std::size_t bit);
+};
+
+#endif /* HIERARCHICAL_BITMAP_HPP */
@@ -91,9 +91,15 @@ void Interrupt::handle(InterruptState* s)
 
         xDeb("Page fault on %p", address);
 
-        if (!(s->errCode & 1) &&
+        // deferred allocations only exist in the areas of the task
+        if (!(s->errCode & 1) && tm->isTaskActive() &&
+            tm->getActiveTask().vmas.find(
+              reinterpret_cast<uintptr_t>(address)) &&
             PageDirectory::getCurrent()->handleFault(address))
           return;
+        if ((s->errCode & 3) == 3 &&
+            PageDirectory::getCurrent()->handleWriteFault(address))
+          return;
 
         xDeb("Page was %s", s->errCode & 1 ? "present" : "not present");
         xDeb("Fault on %s", s->errCode & 2 ? "write" : "read");
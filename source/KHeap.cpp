@@ -1,16 +1,31 @@
 #include "KHeap.hpp"
 #include "PageDirectory.hpp"
+#include "Memory.hpp"
 #include "Util.hpp"
 #include "Symbols.hpp"
+#include "Cpu.hpp"
 #include "Debug.hpp"
 
 XLL_LOG_CATEGORY("core/memory/kheap");
 
-static constexpr unsigned HEADER_SIZE = 4;
-static constexpr unsigned BLOCK_ALIGN_SHIFT = 2;
-static constexpr unsigned BLOCK_ALIGN = 1 << BLOCK_ALIGN_SHIFT;
-static constexpr unsigned BLOCK_MIN_SIZE = HEADER_SIZE + 4;
-
+// the header is padded so that data is aligned like blocks are, this must be
+// kept in sync with the multiboot copy in boot.asm
+static constexpr std::size_t HEADER_SIZE = 16;
+static constexpr std::size_t FOOTER_SIZE = 8;
+static constexpr unsigned BLOCK_ALIGN_SHIFT = 4;
+static constexpr std::size_t BLOCK_ALIGN = 1 << BLOCK_ALIGN_SHIFT;
+// a free block must be able to hold its free list links and its footer
+static constexpr std::size_t BLOCK_MIN_SIZE =
+  intAlignSup(HEADER_SIZE + 2 * sizeof(void*) + FOOTER_SIZE, BLOCK_ALIGN);
+
+/**
+ * A block of the heap
+ *
+ * Each block starts with a header holding its size and whether it and the
+ * previous block are used. Free blocks also hold the links of their free list
+ * and end with a footer repeating their size, so that a block can find its
+ * previous neighbour when the latter is free and merge with it.
+ */
 class KHeap::HeapBlock
 {
   public:
@@ -21,11 +36,11 @@ class KHeap::HeapBlock
       return &data;
     }
 
-    uint32_t getSize() const
+    std::size_t getSize() const
     {
-      return state.sizeUpper << BLOCK_ALIGN_SHIFT;
+      return static_cast<std::size_t>(state.sizeUpper) << BLOCK_ALIGN_SHIFT;
     }
-    void setSize(uint32_t asize)
+    void setSize(std::size_t asize)
     {
       assert(asize % BLOCK_ALIGN == 0);
       state.sizeUpper = asize >> BLOCK_ALIGN_SHIFT;
@@ -40,48 +55,112 @@ class KHeap::HeapBlock
       state.used = used;
     }
 
+    bool getPrevUsed() const
+    {
+      return state.prevUsed;
+    }
+    void setPrevUsed(bool prevUsed)
+    {
+      state.prevUsed = prevUsed;
+    }
+
+    /// Get the block that follows this one in memory
+    HeapBlock* getNext()
+    {
+      return ptrAdd(this, getSize());
+    }
+    /// Get the block that precedes this one in memory, it must be free
+    HeapBlock* getPrev()
+    {
+      assert(!getPrevUsed());
+      const uint64_t prevSize = *ptrAdd(reinterpret_cast<uint64_t*>(this),
+          -static_cast<intptr_t>(FOOTER_SIZE));
+      return ptrAdd(this, -static_cast<intptr_t>(prevSize));
+    }
+    void writeFooter()
+    {
+      assert(!getUsed());
+      *ptrAdd(reinterpret_cast<uint64_t*>(this), getSize() - FOOTER_SIZE) =
+        getSize();
+    }
+
+    HeapBlock*& nextFree()
+    {
+      assert(!getUsed());
+      return getLinks().next;
+    }
+    HeapBlock*& prevFree()
+    {
+      assert(!getUsed());
+      return getLinks().prev;
+    }
+
   private:
     struct State
     {
-      unsigned used : 1;
-      unsigned avl : 1;
-      unsigned sizeUpper : 30;
+      uint64_t used : 1;
+      uint64_t prevUsed : 1;
+      uint64_t sizeUpper : 62;
     };
 
-    static_assert(sizeof(State) == 4, "sizeof(State) != 4");
+    static_assert(sizeof(State) == 8, "sizeof(State) != 8");
+
+    // data is aligned on BLOCK_ALIGN, the links need not be packed
+    struct Links
+    {
+      HeapBlock* next;
+      HeapBlock* prev;
+    };
 
     union
     {
       State state;
-      uint32_t size;
+      uint64_t size;
     };
+    uint64_t padding;
     uint8_t data;
+
+    Links& getLinks()
+    {
+      return *reinterpret_cast<Links*>(&data);
+    }
 } __attribute__((packed));
 
+/// Get the bin of a free block of size \p size (floor(log2(size)))
+static unsigned sizeToBin(std::size_t size)
+{
+  return 63 - __builtin_clzll(size);
+}
+
 KHeap& KHeap::get()
 {
   static KHeap g_heap;
   return g_heap;
 }
 
+static constexpr std::size_t INITIAL_HEAP_SIZE = 0x200000;
+/// The shrink threshold is not raised over this on its own
+static constexpr std::size_t MAX_SHRINK_THRESHOLD = 0x100000;
+
 void KHeap::init()
 {
-  uint32_t initialSize = 0x200000;
+  std::size_t initialSize = INITIAL_HEAP_SIZE;
 
   m_heapStart = Symbols::getHeapBase();
   m_heapEnd = m_heapStart + initialSize;
   HeapBlock* block = reinterpret_cast<HeapBlock*>(m_heapStart);
 
-  // multiboot header is at heap + 4 aligned to 8, treat it as a block
+  // multiboot header was copied as the data of the first block
   {
-    const uint32_t mbSize =
-      *reinterpret_cast<uint32_t*>(ptrAlignSup(m_heapStart + HEADER_SIZE, 8));
-    const uint32_t blockSize =
+    const uint32_t mbSize = *reinterpret_cast<uint32_t*>(block->getData());
+    const std::size_t blockSize =
       intAlignSup(mbSize, BLOCK_ALIGN) + HEADER_SIZE;
     xDeb("Multiboot header size is %d bytes", mbSize);
     assert(blockSize > BLOCK_MIN_SIZE);
     block->setSize(blockSize);
     block->setUsed(true);
+    // there is nothing before the first block
+    block->setPrevUsed(true);
 
     block = reinterpret_cast<HeapBlock*>(m_heapStart + blockSize);
 
@@ -90,75 +169,107 @@ void KHeap::init()
 
   block->setSize(initialSize);
   block->setUsed(false);
+  block->setPrevUsed(true);
   m_lastBlock = block;
+  insertFreeBlock(block);
+}
+
+void KHeap::initPagedHeaps()
+{
+  m_slabHeap.init(Symbols::getSlabHeapBase());
+  m_largeHeap.init(Symbols::getLargeHeapBase());
+}
+
+void* KHeap::kmalloc(std::size_t size)
+{
+  return kmallocAligned(size, BLOCK_ALIGN);
+}
+
+void* KHeap::kmallocAtomic(std::size_t size)
+{
+  xDeb("kmallocAtomic(%d)", size);
+  if (!size)
+    return nullptr;
+
+  if (size <= SlabHeap::MaxSize && m_slabHeap.isReady())
+    return m_slabHeap.kmallocAtomic(size);
+
+  return allocateFromBlocks(size, BLOCK_ALIGN, true);
 }
 
-void* KHeap::kmalloc(uint32_t size)
+void* KHeap::kmallocAligned(std::size_t size, std::size_t align)
 {
-  xDeb("kmalloc(%d)", size);
+  xDeb("kmalloc(%d, %d)", size, align);
+  assert(align && (align & (align - 1)) == 0 &&
+      "Alignment must be a power of 2");
   if (!size)
     return nullptr;
 
-  auto lock = m_mutex.getScoped();
+  // slabs are mapped on demand, so until pages can be allocated, everything
+  // must come from the premapped part of the heap. Slab objects are aligned on
+  // their size.
+  if (std::max(size, align) <= SlabHeap::MaxSize && m_slabHeap.isReady())
+    return m_slabHeap.kmalloc(std::max(size, align));
+
+  // large buffers get their own pages, they are page-aligned
+  if (size >= LargeHeap::MinSize && align <= PAGE_SIZE &&
+      m_largeHeap.isReady())
+    return m_largeHeap.kmalloc(size);
+
+  return allocateFromBlocks(size, align, false);
+}
 
+void* KHeap::allocateFromBlocks(std::size_t size, std::size_t align,
+    bool atomic)
+{
   // count header
   size += HEADER_SIZE;
   // ceil to align
   size = intAlignSup(size, BLOCK_ALIGN);
+  // the block must be able to hold free list links once freed
+  size = std::max(size, BLOCK_MIN_SIZE);
+
+  // room needed to cut a free block in front of the aligned one
+  const std::size_t padding = align > BLOCK_ALIGN ? align + BLOCK_MIN_SIZE : 0;
 
-  HeapBlock* block = nullptr;
-  char* ptr = m_heapStart;
-  while (ptr < m_heapEnd)
+  while (true)
   {
-    block = reinterpret_cast<HeapBlock*>(ptr);
-    uint32_t blockSize = block->getSize();
+    {
+      auto lock = m_lock.getScoped();
 
-    assert(block <= m_lastBlock);
-    assert(blockSize >= BLOCK_MIN_SIZE);
+      if (HeapBlock* block = findFreeBlock(size + padding))
+        return allocateBlock(block, size, align);
+    }
 
-    if (!block->getUsed())
+    if (atomic)
     {
-      // if block has exact needed size or block is non splittable
-      if (size < blockSize && size >= blockSize - BLOCK_MIN_SIZE)
-      {
-        block->setUsed(true);
-        assert(block->getSize() >= size);
-        return block->getData();
-      }
-      // if block is larger and must be splitted
-      else if (size < blockSize)
-      {
-        std::pair<HeapBlock*, HeapBlock*> blocks = splitBlock(block, size);
-
-        // if this was the last block, there is a new last block
-        if (block == m_lastBlock)
-          m_lastBlock = blocks.second;
-
-        block = blocks.first;
-        block->setUsed(true);
-
-        assert(!blocks.second->getUsed());
-        assert(blocks.second->getSize() >= BLOCK_MIN_SIZE);
-        assert(block->getSize() >= size);
-
-        return block->getData();
-      }
+      xDeb("No free block for an atomic allocation");
+      return nullptr;
     }
 
-    ptr += blockSize;
+    enlargeHeap(size + padding);
   }
+}
 
-  xDeb("Heap enlarge");
-
-  // count last block size if it's free
-  assert(block == m_lastBlock);
-  const uint32_t blockSize = block->getUsed() ? 0 : block->getSize();
-  // asked size - last block size if it's free -> round up
-  const uint32_t neededPages = (size - blockSize + 0x1000-1) / 0x1000;
+void* KHeap::allocateBlock(HeapBlock* block, std::size_t size,
+    std::size_t align)
+{
+  assert(!block->getUsed());
 
-  enlargeHeap(neededPages);
+  removeFreeBlock(block);
 
-  block = m_lastBlock;
+  if (align > BLOCK_ALIGN)
+  {
+    const uintptr_t data = reinterpret_cast<uintptr_t>(block->getData());
+    if (data % align)
+    {
+      // the leading part must be large enough to be a free block
+      const uintptr_t alignedData = intAlignSup(data + BLOCK_MIN_SIZE, align);
+      const auto blocks = splitBlock(block, alignedData - data);
+      insertFreeBlock(blocks.first);
+      block = blocks.second;
+    }
+  }
 
   assert(size <= block->getSize());
 
@@ -167,48 +278,155 @@ void* KHeap::kmalloc(uint32_t size)
   {
     const auto blocks = splitBlock(block, size);
     block = blocks.first;
-    m_lastBlock = blocks.second;
+    insertFreeBlock(blocks.second);
   }
 
   block->setUsed(true);
+  if (block != m_lastBlock)
+    block->getNext()->setPrevUsed(true);
 
-  assert(block->getSize() >= size);
+  assert(reinterpret_cast<uintptr_t>(block->getData()) % align == 0);
   assert(reinterpret_cast<char*>(m_lastBlock) + m_lastBlock->getSize() ==
          m_heapEnd);
 
   return block->getData();
 }
 
-void KHeap::enlargeHeap(const std::size_t pageCount)
+auto KHeap::findFreeBlock(std::size_t size) -> HeapBlock*
 {
-  for (uint32_t i = 0; i < pageCount; ++i)
+  const unsigned bin = sizeToBin(size);
+
+  // blocks in the bin of the requested size may be too small, look for the
+  // first that fits, but only look at a few of them to bound the time spent
+  // with interrupts disabled
+  unsigned scanned = 0;
+  for (HeapBlock* block = m_freeBins[bin];
+      block && scanned < MAX_BIN_SCAN;
+      block = block->nextFree(), ++scanned)
+    if (block->getSize() >= size)
+      return block;
+
+  // any block of the next non-empty bin is large enough
+  if (bin == BIN_COUNT - 1)
+    return nullptr;
+  const uint64_t largerBins = m_nonEmptyBins & ~((2ull << bin) - 1);
+  if (!largerBins)
+    return nullptr;
+
+  return m_freeBins[__builtin_ctzll(largerBins)];
+}
+
+void KHeap::insertFreeBlock(HeapBlock* block)
+{
+  assert(!block->getUsed());
+
+  const unsigned bin = sizeToBin(block->getSize());
+
+  block->writeFooter();
+  block->prevFree() = nullptr;
+  block->nextFree() = m_freeBins[bin];
+  if (m_freeBins[bin])
+    m_freeBins[bin]->prevFree() = block;
+  m_freeBins[bin] = block;
+  m_nonEmptyBins |= 1ull << bin;
+}
+
+void KHeap::removeFreeBlock(HeapBlock* block)
+{
+  assert(!block->getUsed());
+
+  const unsigned bin = sizeToBin(block->getSize());
+
+  HeapBlock* const next = block->nextFree();
+  HeapBlock* const prev = block->prevFree();
+
+  if (next)
+    next->prevFree() = prev;
+  if (prev)
+    prev->nextFree() = next;
+  else
   {
-    // FIXME kmalloc may be reentered here because of Memory, Memory should
-    // allocate its vector on another heap
-    PageDirectory::getKernelDirectory()->mapPage(m_heapEnd,
-        PageDirectory::ATTR_RW | PageDirectory::ATTR_NOEXEC);
-    m_heapEnd += PAGE_SIZE;
-
-    HeapBlock* block;
-    if (m_lastBlock->getUsed())
-    {
-      // if last block is used, create a new block
-      block = ptrAdd(m_lastBlock, m_lastBlock->getSize());
+    assert(m_freeBins[bin] == block);
+    m_freeBins[bin] = next;
+    if (!next)
+      m_nonEmptyBins &= ~(1ull << bin);
+  }
+}
+
+void KHeap::enlargeHeap(std::size_t size)
+{
+  // only one task may move the end of the heap at a time
+  auto growLock = m_growMutex.getScoped();
 
-      assert(reinterpret_cast<uint64_t>(block) % PAGE_SIZE == 0);
-      assert(reinterpret_cast<char*>(block) < m_heapEnd);
+  char* oldHeapEnd;
+  std::size_t pageCount;
+  {
+    auto lock = m_lock.getScoped();
 
-      // set size to 0, it will be updated below
-      block->setSize(0);
+    // someone else may have grown the heap while we were waiting
+    if (findFreeBlock(size))
+      return;
 
-      m_lastBlock = block;
+    xDeb("Heap enlarge");
+
+    // the pages given back by the last shrink are needed again, shrink less
+    // eagerly so that cycling around the threshold stops remapping
+    if (m_shrunk)
+    {
+      m_shrinkThreshold = std::max(m_shrinkThreshold,
+          std::min(m_shrinkThreshold * 2, MAX_SHRINK_THRESHOLD));
+      m_shrunk = false;
     }
-    else
-      // else enlarge it
-      block = m_lastBlock;
 
-    block->setSize(block->getSize() + PAGE_SIZE);
+    // count last block size if it's free
+    const std::size_t blockSize =
+      m_lastBlock->getUsed() ? 0 : m_lastBlock->getSize();
+    // asked size - last block size if it's free -> round up
+    pageCount = (size - std::min(size, blockSize) + PAGE_SIZE-1) / PAGE_SIZE;
+    pageCount = std::max<std::size_t>(pageCount, 1);
+    oldHeapEnd = m_heapEnd;
+
+    // the large heap region follows
+    if (pageCount * PAGE_SIZE >
+        reinterpret_cast<uintptr_t>(Symbols::getLargeHeapBase()) -
+        reinterpret_cast<uintptr_t>(oldHeapEnd))
+      PANIC("Kernel heap is full");
+  }
+
+  // m_heapEnd can't move while we hold m_growMutex, pages after it are ours.
+  // Mapping may sleep, so it must be done without the spinlock.
+  PageDirectory::getKernelDirectory()->mapRange(oldHeapEnd,
+      oldHeapEnd + pageCount * PAGE_SIZE,
+      PageDirectory::ATTR_RW | PageDirectory::ATTR_NOEXEC);
+
+  auto lock = m_lock.getScoped();
+
+  assert(m_heapEnd == oldHeapEnd);
+
+  const std::size_t addedSize = pageCount * PAGE_SIZE;
+  m_heapEnd += addedSize;
+
+  if (m_lastBlock->getUsed())
+  {
+    // if last block is used, create a new block
+    HeapBlock* block = reinterpret_cast<HeapBlock*>(oldHeapEnd);
+
+    assert(reinterpret_cast<uint64_t>(block) % PAGE_SIZE == 0);
+
+    block->setSize(addedSize);
+    block->setUsed(false);
+    block->setPrevUsed(true);
+
+    m_lastBlock = block;
   }
+  else
+  {
+    // else enlarge it, it changes size so it may change bin
+    removeFreeBlock(m_lastBlock);
+    m_lastBlock->setSize(m_lastBlock->getSize() + addedSize);
+  }
+
+  insertFreeBlock(m_lastBlock);
 
   assert(reinterpret_cast<char*>(m_lastBlock) + m_lastBlock->getSize() ==
          m_heapEnd);
@@ -219,28 +437,185 @@ void KHeap::kfree(void* ptr)
   if (!ptr)
     return;
 
-  auto lock = m_mutex.getScoped();
+  if (m_slabHeap.owns(ptr))
+  {
+    m_slabHeap.kfree(ptr);
+    return;
+  }
 
-  HeapBlock* block =
-    reinterpret_cast<HeapBlock*>(ptrAdd(ptr, -(int)HEADER_SIZE));
+  if (m_largeHeap.owns(ptr))
+  {
+    m_largeHeap.kfree(ptr);
+    return;
+  }
+
+  freeToBlocks(ptr);
+}
+
+void KHeap::freeToBlocks(void* ptr)
+{
+  // giving pages back may sleep, don't do it from an interrupt handler or
+  // under a spinlock
+  const bool canSleep = Cpu::rflags() & (1 << 9);
+
+  bool shrink;
+  {
+    auto lock = m_lock.getScoped();
+    freeBlock(
+        reinterpret_cast<HeapBlock*>(ptrAdd(ptr, -(intptr_t)HEADER_SIZE)));
+    shrink = canSleep && !m_lastBlock->getUsed() &&
+      m_lastBlock->getSize() > m_shrinkThreshold;
+  }
+
+  if (shrink)
+    shrinkHeap();
+}
+
+void KHeap::freeBlock(HeapBlock* block)
+{
+  assert(block->getUsed() && "Double free");
   block->setUsed(false);
-  // TODO merge free blocks
+
+  // merge with the next block
+  if (block != m_lastBlock)
+  {
+    HeapBlock* next = block->getNext();
+    if (!next->getUsed())
+    {
+      removeFreeBlock(next);
+      if (next == m_lastBlock)
+        m_lastBlock = block;
+      block->setSize(block->getSize() + next->getSize());
+    }
+  }
+
+  // merge with the previous block
+  if (!block->getPrevUsed())
+  {
+    HeapBlock* prev = block->getPrev();
+    assert(!prev->getUsed());
+    removeFreeBlock(prev);
+    if (block == m_lastBlock)
+      m_lastBlock = prev;
+    prev->setSize(prev->getSize() + block->getSize());
+    block = prev;
+  }
+
+  if (block != m_lastBlock)
+    block->getNext()->setPrevUsed(false);
+
+  insertFreeBlock(block);
+}
+
+void KHeap::kfree(void* ptr, std::size_t size)
+{
+  if (!ptr)
+    return;
+
+  // the size gives the slab class without looking up the page
+  if (m_slabHeap.owns(ptr))
+  {
+    m_slabHeap.kfree(ptr, size);
+    return;
+  }
+
+  if (m_largeHeap.owns(ptr))
+  {
+    m_largeHeap.kfree(ptr);
+    return;
+  }
+
+  freeToBlocks(ptr);
+}
+
+void KHeap::setShrinkThreshold(std::size_t threshold)
+{
+  auto lock = m_lock.getScoped();
+  m_shrinkThreshold = threshold;
+  m_shrunk = false;
+}
+
+void KHeap::shrinkHeap()
+{
+  auto growLock = m_growMutex.getScoped();
+
+  char* newHeapEnd;
+  char* oldHeapEnd;
+  {
+    auto lock = m_lock.getScoped();
+
+    // the last block may have been used while we were waiting
+    if (m_lastBlock->getUsed() || m_lastBlock->getSize() <= m_shrinkThreshold)
+      return;
+
+    // keep half the threshold mapped after the last block header so that
+    // allocating and freeing around the threshold does not remap every time,
+    // and never go under the premapped part of the heap, it was not allocated
+    // through Memory
+    newHeapEnd = std::max(
+        ptrAlignSup(reinterpret_cast<char*>(m_lastBlock) + BLOCK_MIN_SIZE +
+          m_shrinkThreshold / 2, PAGE_SIZE),
+        m_heapStart + INITIAL_HEAP_SIZE);
+    oldHeapEnd = m_heapEnd;
+
+    if (newHeapEnd >= oldHeapEnd)
+      return;
+
+    removeFreeBlock(m_lastBlock);
+    m_lastBlock->setSize(m_lastBlock->getSize() - (oldHeapEnd - newHeapEnd));
+    insertFreeBlock(m_lastBlock);
+    m_heapEnd = newHeapEnd;
+    m_shrunk = true;
+
+    assert(reinterpret_cast<char*>(m_lastBlock) + m_lastBlock->getSize() ==
+           m_heapEnd);
+  }
+
+  xDeb("Heap shrink by %d pages", (oldHeapEnd - newHeapEnd) / PAGE_SIZE);
+
+  // the pages are out of the heap and m_heapEnd can't move while we hold
+  // m_growMutex, so they can be unmapped without the spinlock
+  PageDirectory::getKernelDirectory()->unmapRange(newHeapEnd, oldHeapEnd,
+      [](physaddr_t phys) {
+        Memory::get().setPageFree(phys / PAGE_SIZE);
+      });
+}
+
+KHeap::Stats KHeap::getStats()
+{
+  auto lock = m_lock.getScoped();
+
+  Stats stats{};
+  stats.heapSize = m_heapEnd - m_heapStart;
+  for (HeapBlock* bin : m_freeBins)
+    for (HeapBlock* block = bin; block; block = block->nextFree())
+    {
+      ++stats.freeBlockCount;
+      stats.freeSize += block->getSize();
+      stats.largestFreeBlock =
+        std::max<uint64_t>(stats.largestFreeBlock, block->getSize());
+    }
+  return stats;
 }
 
 std::pair<KHeap::HeapBlock*, KHeap::HeapBlock*> KHeap::splitBlock(
-    HeapBlock* block, uint64_t size)
+    HeapBlock* block, std::size_t size)
 {
   assert(!block->getUsed());
 
   // block is too small to be split!
   assert(size <= block->getSize() - BLOCK_MIN_SIZE);
 
-  uint32_t fullSize = block->getSize();
+  const std::size_t fullSize = block->getSize();
   HeapBlock* nextBlock = ptrAdd(block, size);
 
   block->setSize(size);
   nextBlock->setSize(fullSize - size);
   nextBlock->setUsed(false);
+  nextBlock->setPrevUsed(block->getUsed());
+
+  if (block == m_lastBlock)
+    m_lastBlock = nextBlock;
 
   return {block, nextBlock};
 }
@@ -259,3 +634,9 @@ void* malloc(size_t size)
 }
 
 }
+
+// sized deallocation, libc++ only provides a weak definition
+void operator delete(void* ptr, std::size_t size) noexcept
+{
+  KHeap::get().kfree(ptr, size);
+}
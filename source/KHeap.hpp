@@ -5,6 +5,9 @@
 #include <utility>
 #include <cassert>
 #include "Mutex.hpp"
+#include "SpinLock.hpp"
+#include "SlabHeap.hpp"
+#include "LargeHeap.hpp"
 
 class KHeap
 {
@@ -15,24 +18,98 @@ class KHeap
     KHeap(const KHeap&) = delete;
     KHeap& operator=(const KHeap&) = delete;
 
-    void* kmalloc(uint32_t size);
+    struct Stats
+    {
+      /// Size of the block heap, not counting slabs
+      uint64_t heapSize;
+      uint64_t freeSize;
+      uint64_t freeBlockCount;
+      uint64_t largestFreeBlock;
+    };
+
+    void* kmalloc(std::size_t size);
+    /** Allocate \p size bytes without sleeping
+     *
+     * This is safe to call from an interrupt handler or with a spinlock held.
+     * It only takes objects that are already free and never maps pages, so
+     * it returns nullptr when that is not enough. Freeing the result with
+     * kfree is also safe in these contexts.
+     */
+    void* kmallocAtomic(std::size_t size);
+    /// Allocate \p size bytes aligned on \p align, which must be a power of 2
+    void* kmallocAligned(std::size_t size, std::size_t align);
     void kfree(void* ptr);
+    /** Free \p ptr which was allocated with a size of \p size
+     *
+     * This skips looking up the slab class of \p ptr. It must come from
+     * kmalloc, or from kmallocAligned with an alignment not above \p size.
+     */
+    void kfree(void* ptr, std::size_t size);
+
+    /// Get statistics about the fragmentation of the block heap
+    Stats getStats();
+
+    /** Set the size over which a free block at the end of the heap is given
+     * back to Memory
+     *
+     * Half of \p threshold stays mapped after a shrink. The threshold is
+     * doubled, up to 1MB, when the heap grows again after a shrink.
+     */
+    void setShrinkThreshold(std::size_t threshold);
 
     void init();
+    /** Enable the slab and large object heaps, must be called once pages can be
+     * allocated
+     */
+    void initPagedHeaps();
 
   private:
     class HeapBlock;
 
-    Mutex m_mutex;
+    /// Protects the blocks and free lists, held for a bounded time
+    SpinLock m_lock;
+    /// Serializes moves of m_heapEnd, which need to (un)map pages
+    Mutex m_growMutex;
+
+    SlabHeap m_slabHeap;
+    LargeHeap m_largeHeap;
 
     char* m_heapStart;
     char* m_heapEnd;
     HeapBlock* m_lastBlock;
 
+    static constexpr unsigned BIN_COUNT = 64;
+    /// Maximum number of blocks looked at in a bin during an allocation
+    static constexpr unsigned MAX_BIN_SCAN = 8;
+
+    /// Free blocks, binned by floor(log2(size))
+    HeapBlock* m_freeBins[BIN_COUNT] = {};
+    /// Bitmap of the non-empty bins
+    uint64_t m_nonEmptyBins = 0;
+
+    std::size_t m_shrinkThreshold = 0x40000;
+    /// The heap was shrunk and has not grown since
+    bool m_shrunk = false;
+
+    void* allocateFromBlocks(std::size_t size, std::size_t align, bool atomic);
+    /// Take \p size bytes aligned on \p align out of free \p block
+    void* allocateBlock(HeapBlock* block, std::size_t size, std::size_t align);
+    /// Mark \p block as free and merge it with its neighbours
+    void freeBlock(HeapBlock* block);
+    HeapBlock* findFreeBlock(std::size_t size);
+    void insertFreeBlock(HeapBlock* block);
+    void removeFreeBlock(HeapBlock* block);
+
+    /// Split \p block and update m_lastBlock if needed
     std::pair<HeapBlock*, HeapBlock*> splitBlock(HeapBlock* block,
         uint64_t size);
-    /// Enlarge the heap and updates m_lastBlock
-    void enlargeHeap(std::size_t pageCount);
+    /// Free \p ptr from the block heap and shrink it if needed
+    void freeToBlocks(void* ptr);
+    /// Enlarge the heap to have a free block of \p size and update m_lastBlock
+    void enlargeHeap(std::size_t size);
+    /// Unmap the last block down to half the threshold if it is free and
+    /// large enough
+    void shrinkHeap();
 };
 
 #endif /* K_HEAP_HPP */
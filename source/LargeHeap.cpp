@@ -0,0 +1,110 @@
+#include "LargeHeap.hpp"
+#include "PageDirectory.hpp"
+#include "Memory.hpp"
+#include "Util.hpp"
+#include "Debug.hpp"
+
+XLL_LOG_CATEGORY("core/memory/largeheap");
+
+void LargeHeap::init(char* heapStart)
+{
+  m_heapStart = heapStart;
+}
+
+void* LargeHeap::kmalloc(std::size_t size)
+{
+  const std::size_t pageCount = intAlignSup(size, PAGE_SIZE) / PAGE_SIZE;
+
+  std::size_t first;
+  {
+    auto lock = m_mutex.getScoped();
+
+    // one more page stays unmapped as a guard
+    first = findFreeRange(pageCount + 1);
+    if (first == MaxPageCount)
+      PANIC("Large heap is full");
+
+    setReserved(first, first + pageCount + 1, true);
+    m_pageCounts[first] = pageCount;
+    m_mappedPageCount += pageCount;
+  }
+
+  char* const start = m_heapStart + first * PAGE_SIZE;
+
+  xDeb("Mapping %d pages at %p", pageCount, start);
+
+  // mapping may allocate and reenter the heap, so it must be done unlocked
+  PageDirectory::getKernelDirectory()->mapRange(start,
+      start + pageCount * PAGE_SIZE,
+      PageDirectory::ATTR_RW | PageDirectory::ATTR_NOEXEC);
+
+  return start;
+}
+
+void LargeHeap::kfree(void* ptr)
+{
+  assert(owns(ptr));
+  assert(reinterpret_cast<uintptr_t>(ptr) % PAGE_SIZE == 0 &&
+      "Freeing a pointer in the middle of a large allocation");
+
+  char* const start = static_cast<char*>(ptr);
+  const std::size_t first = (start - m_heapStart) / PAGE_SIZE;
+
+  std::size_t pageCount;
+  {
+    auto lock = m_mutex.getScoped();
+
+    pageCount = m_pageCounts[first];
+    assert(pageCount && "Double free");
+    m_pageCounts[first] = 0;
+  }
+
+  PageDirectory::getKernelDirectory()->unmapRange(start, start + pageCount * PAGE_SIZE, [](physaddr_t phys) {
+        Memory::get().setPageFree(phys / PAGE_SIZE);
+      });
+
+  xDeb("Unmapped %d pages at %p", pageCount, start);
+
+  auto lock = m_mutex.getScoped();
+
+  setReserved(first, first + pageCount + 1, false);
+  m_mappedPageCount -= pageCount;
+}
+
+void LargeHeap::setReserved(std::size_t from, std::size_t to, bool reserved)
+{
+  for (std::size_t page = from; page < to; ++page)
+  {
+    const uint64_t bit = 1ull << page % BitsPerWord;
+    if (reserved)
+      m_reservedPages[page / BitsPerWord] |= bit;
+    else
+      m_reservedPages[page / BitsPerWord] &= ~bit;
+  }
+}
+
+std::size_t LargeHeap::findFreeRange(std::size_t count) const
+{
+  std::size_t runStart = 0;
+  for (std::size_t word = 0; word < MaxPageCount / BitsPerWord; ++word)
+  {
+    // go from one run of reserved pages to the next, free words are skipped
+    // as a whole
+    uint64_t reserved = m_reservedPages[word];
+    while (reserved)
+    {
+      const unsigned bit = __builtin_ctzll(reserved);
+      const std::size_t page = word * BitsPerWord + bit;
+      if (page - runStart >= count)
+        return runStart;
+
+      const uint64_t free = ~reserved >> bit;
+      const unsigned length = free ? __builtin_ctzll(free) : BitsPerWord - bit;
+      runStart = page + length;
+      reserved = bit + length < BitsPerWord ?
+        reserved & (~0ull << (bit + length)) : 0;
+    }
+  }
+
+  return MaxPageCount - runStart >= count ? runStart : MaxPageCount;
+}
@@ -0,0 +1,74 @@
+#ifndef LARGE_HEAP_HPP
+#define LARGE_HEAP_HPP
+
+#include <cstdint>
+#include <cstddef>
+
+#include "Mutex.hpp"
+#include "Types.hpp"
+
+/**
+ * Allocator for large kernel buffers
+ *
+ * Each allocation gets its own page-aligned range of the large heap region,
+ * mapped page by page and followed by an unmapped guard page. Freeing unmaps
+ * the range and gives its pages back to Memory, so large buffers neither
+ * fragment the block heap nor stay mapped once freed.
+ */
+class LargeHeap
+{
+public:
+  /// Allocations of this size and above should go to this heap
+  static constexpr std::size_t MinSize = 0x10000;
+
+  /// Size of the large heap region in pages (128MB)
+  static constexpr std::size_t MaxPageCount = 0x8000;
+
+  LargeHeap() = default;
+  LargeHeap(const LargeHeap&) = delete;
+  LargeHeap& operator=(const LargeHeap&) = delete;
+
+  void init(char* heapStart);
+  bool isReady() const
+  {
+    return m_heapStart;
+  }
+
+  /// Allocate \p size bytes, the result is page-aligned
+  void* kmalloc(std::size_t size);
+  void kfree(void* ptr);
+
+  /// Tell if \p ptr was allocated by this heap
+  bool owns(const void* ptr) const
+  {
+    // the region ends at the top of the address space, its end wraps to 0
+    return m_heapStart && reinterpret_cast<uintptr_t>(ptr) -
+      reinterpret_cast<uintptr_t>(m_heapStart) < MaxPageCount * PAGE_SIZE;
+  }
+
+  /// Get the number of pages currently mapped
+  uint64_t getPageCount() const
+  {
+    return m_mappedPageCount;
+  }
+
+private:
+  static constexpr std::size_t BitsPerWord = 64;
+
+  Mutex m_mutex;
+
+  char* m_heapStart = nullptr;
+
+  /// Bitmap of the pages reserved by an allocation, including guard pages
+  uint64_t m_reservedPages[MaxPageCount / BitsPerWord] = {};
+  /// Number of mapped pages of each allocation, by its first page
+  uint16_t m_pageCounts[MaxPageCount] = {};
+  uint64_t m_mappedPageCount = 0;
+
+  void setReserved(std::size_t from, std::size_t to, bool reserved);
+
+  /// Find \p count consecutive free pages and return the index of the first
+  std::size_t findFreeRange(std::size_t count) const;
+};
+
+#endif /* LARGE_HEAP_HPP */
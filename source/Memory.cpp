@@ -1,5 +1,6 @@
 #include "Memory.hpp"
 #include "Util.hpp"
+#include <algorithm>
 #include "Debug.hpp"
 
 XLL_LOG_CATEGORY("core/memory/memorymap");
@@ -10,45 +11,279 @@ Memory& Memory::get()
   return memory;
 }
 
+void Memory::init(page_t frameCount)
+{
+  xDeb("Initializing memory map for %d frames", frameCount);
+  assert(frameCount <= MaxFrameCount && "Frame map too large for the heap");
+
+  _freeFrames.init(frameCount);
+  _usedPageCount = frameCount;
+}
+
+void Memory::addUsableRange(page_t from, page_t to)
+{
+  assert(!_frames && "Usable memory declared after frame database init");
+
+  to = std::min<page_t>(to, _freeFrames.size());
+  if (from >= to)
+    return;
+
+  xDeb("Usable frames: %x-%x", from, to);
+
+  auto _ = _lock.getScoped();
+
+  _usableRanges.emplace_back(from, to);
+  _usedPageCount -= _freeFrames.assignRange(from, to, true);
+}
+
+void Memory::initFrameDatabase()
+{
+  assert(!_frames && "Frame database initialized twice");
+
+  const page_t frameCount = _freeFrames.size();
+
+  xDeb("Initializing frame database (%d bytes)", frameCount * sizeof(Frame));
+
+  // this maps pages, so it must be done before locking
+  Frame* frames = new Frame[frameCount];
+
+  auto _ = _lock.getScoped();
+
+  for (page_t page = 0; page < frameCount; ++page)
+    frames[page].flags = FRAME_RESERVED;
+  for (const auto& range : _usableRanges)
+    for (page_t page = range.first; page < range.second; ++page)
+      frames[page].flags = 0;
+
+  // frames used until now, like the kernel image, have a single owner
+  for (page_t page = 0; page < frameCount; ++page)
+    frames[page].refCount =
+      !(frames[page].flags & FRAME_RESERVED) && !_freeFrames.test(page);
+
+  _frames = frames;
+}
+
+void Memory::addReclaimHandler(ReclaimHandler handler, void* data)
+{
+  auto _ = _lock.getScoped();
+
+  assert(_reclaimHandlerCount < MaxReclaimHandlers &&
+      "Too many reclaim handlers");
+  _reclaimHandlers[_reclaimHandlerCount++] = {handler, data};
+}
+
+bool Memory::reclaim()
+{
+  std::size_t handlerCount;
+  {
+    auto _ = _lock.getScoped();
+    handlerCount = _reclaimHandlerCount;
+  }
+
+  xDeb("Out of memory, reclaiming from %d caches", handlerCount);
+
+  // handlers give pages back through the usual functions, so they are called
+  // unlocked
+  std::size_t reclaimed = 0;
+  for (std::size_t i = 0; i < handlerCount; ++i)
+    reclaimed +=
+      _reclaimHandlers[i].first(_reclaimHandlers[i].second);
+
+  xDeb("Reclaimed %d pages", reclaimed);
+
+  return reclaimed;
+}
+
 page_t Memory::getFreePage()
 {
   xDeb("Free page request");
 
-  for (page_t i = 0; i < _frames.size(); ++i)
-    if (!_frames[i])
+  do
+  {
+    auto _ = _lock.getScoped();
+
+    const page_t page = getFreePageLocked();
+    if (page != INVALID_PAGE)
+      return page;
+  } while (reclaim());
+
+  PANIC("Out of physical memory");
+}
+
+page_t Memory::getFreePageLocked()
+{
+  if (_hotFrameCount)
+  {
+    const page_t page = _hotFrames[--_hotFrameCount];
+    if (_frames)
+    {
+      assert(!_frames[page].refCount);
+      _frames[page].refCount = 1;
+    }
+    ++_usedPageCount;
+    return page;
+  }
+
+  const std::size_t page = _freeFrames.findFirstSet();
+  if (page == HierarchicalBitmap::npos)
+    return INVALID_PAGE;
+
+  setPageUsedLocked(page);
+  return page;
+}
+
+page_t Memory::getFreePages(std::size_t count, std::size_t alignment)
+{
+  xDeb("Free pages request (count: %d, alignment: %d)", count, alignment);
+
+  assert(count);
+  assert(alignment && (alignment & (alignment - 1)) == 0 &&
+      "Alignment must be a power of 2");
+
+  do
+  {
+    auto _ = _lock.getScoped();
+
+    const page_t first = getFreePagesLocked(count, alignment);
+    if (first != INVALID_PAGE)
+      return first;
+  } while (reclaim());
+
+  xDeb("No free range of %d pages", count);
+  return INVALID_PAGE;
+}
+
+page_t Memory::getFreePagesLocked(std::size_t count, std::size_t alignment)
+{
+  std::size_t first = _freeFrames.findFirstSet();
+  while (true)
+  {
+    if (first != HierarchicalBitmap::npos)
+      first = intAlignSup(first, alignment);
+    if (first == HierarchicalBitmap::npos ||
+        first + count > _freeFrames.size())
     {
-      xDeb("Free page got");
-      setPageUsed(i);
-      return i;
+      // the hot frames may be what is missing, retry with them in the map
+      if (!_hotFrameCount)
+        break;
+      drainHotFramesLocked(_hotFrameCount);
+      first = _freeFrames.findFirstSet();
+      continue;
     }
-  xDeb("No more freepage, enlarging...");
-  page_t i = _frames.size();
-  _frames.resize(i+16, false);
-  setPageUsed(i);
-  return i;
+
+    const std::size_t clear = _freeFrames.findNextClear(first, first + count);
+    if (clear == first + count)
+    {
+      for (std::size_t page = first; page < first + count; ++page)
+        setPageUsedLocked(page);
+      return first;
+    }
+
+    // no range can contain this used frame, go past it
+    first = _freeFrames.findNextSet(clear + 1);
+  }
+
+  return INVALID_PAGE;
+}
+
+void Memory::setPagesFree(page_t first, std::size_t count)
+{
+  auto _ = _lock.getScoped();
+
+  for (page_t page = first; page < first + count; ++page)
+    setPageFreeLocked(page);
 }
 
 void Memory::setPageFree(page_t page)
 {
-  //if (_frames.size() <= page)
-  //  _frames.resize(intAlignSup(page+1, 16));
+  auto _ = _lock.getScoped();
+
+  releasePageLocked(page);
+}
+
+void Memory::releasePageLocked(page_t page)
+{
+  assert(page < _freeFrames.size());
+  assert(!_freeFrames.test(page));
+
+  if (_hotFrameCount == HotFrameCapacity)
+    drainHotFramesLocked(HotFrameDrainCount);
+
+  if (_frames)
+  {
+    assert(!(_frames[page].flags & FRAME_RESERVED) &&
+        "Freeing a reserved frame");
+    assert(_frames[page].refCount == 1 && "Freeing a shared frame");
+    _frames[page].refCount = 0;
+  }
+
+  _hotFrames[_hotFrameCount++] = page;
+  --_usedPageCount;
+}
+
+void Memory::drainHotFramesLocked(std::size_t count)
+{
+  assert(count <= _hotFrameCount);
+
+  if (!count)
+    return;
+
+  xDeb("Draining %d hot frames", count);
+
+  // the oldest frames are at the bottom, they are the least likely to be
+  // cached
+  for (std::size_t i = 0; i < count; ++i)
+  {
+    assert(!_freeFrames.test(_hotFrames[i]));
+    _freeFrames.set(_hotFrames[i]);
+  }
+
+  _hotFrameCount -= count;
+  std::copy(_hotFrames + count, _hotFrames + count + _hotFrameCount,
+      _hotFrames);
+}
+
+void Memory::setPageFreeLocked(page_t page)
+{
+  assert(page < _freeFrames.size());
+  assert(!_freeFrames.test(page));
 
-  assert(_frames.size() > page);
-  assert(_frames[page]);
+  if (_frames)
+  {
+    assert(!(_frames[page].flags & FRAME_RESERVED) &&
+        "Freeing a reserved frame");
+    assert(_frames[page].refCount == 1 && "Freeing a shared frame");
+    _frames[page].refCount = 0;
+  }
 
-  _frames[page] = false;
+  _freeFrames.set(page);
   --_usedPageCount;
 }
 
 void Memory::setPageUsed(page_t page)
 {
-  if (_frames.size() <= page)
-    _frames.resize(intAlignSup(page+1, 16));
+  auto _ = _lock.getScoped();
+
+  // the page may be in the hot frames
+  drainHotFramesLocked(_hotFrameCount);
+  setPageUsedLocked(page);
+}
 
-  assert(_frames.size() > page);
-  assert(!_frames[page]);
+void Memory::setPageUsedLocked(page_t page)
+{
+  // reserved areas may be described past the end of memory
+  if (page >= _freeFrames.size())
+    return;
 
-  _frames[page] = true;
+  assert(_freeFrames.test(page));
+
+  if (_frames)
+  {
+    assert(!_frames[page].refCount);
+    _frames[page].refCount = 1;
+  }
+
+  _freeFrames.clear(page);
   ++_usedPageCount;
 }
 
@@ -56,15 +291,94 @@ void Memory::setRangeUsed(page_t from, page_t to)
 {
   assert(from <= to);
 
+  auto _ = _lock.getScoped();
+
+  drainHotFramesLocked(_hotFrameCount);
   for (; from < to; ++from)
-    setPageUsed(from);
+    setPageUsedLocked(from);
 }
 
 void Memory::completeRangeUsed(page_t from, page_t to)
 {
   assert(from <= to);
 
-  for (; from < to; ++from)
-    if (from >= _frames.size() || !_frames[from])
-      setPageUsed(from);
+  to = std::min<page_t>(to, _freeFrames.size());
+  if (from >= to)
+    return;
+
+  auto _ = _lock.getScoped();
+
+  drainHotFramesLocked(_hotFrameCount);
+  if (_frames)
+  {
+    for (; from < to; ++from)
+      if (_freeFrames.test(from))
+        setPageUsedLocked(from);
+  }
+  else
+    _usedPageCount += _freeFrames.assignRange(from, to, false);
+}
+
+uint16_t Memory::getRefCount(page_t page)
+{
+  assert(_frames && page < _freeFrames.size());
+
+  auto _ = _lock.getScoped();
+  return _frames[page].refCount;
+}
+
+void Memory::refPage(page_t page)
+{
+  assert(_frames && page < _freeFrames.size());
+
+  auto _ = _lock.getScoped();
+
+  assert(_frames[page].refCount && "Referencing a free frame");
+  assert(_frames[page].refCount != UINT16_MAX);
+  ++_frames[page].refCount;
+}
+
+void Memory::unrefPage(page_t page)
+{
+  assert(_frames && page < _freeFrames.size());
+
+  auto _ = _lock.getScoped();
+
+  assert(_frames[page].refCount && "Unreferencing a free frame");
+  if (_frames[page].refCount == 1)
+    releasePageLocked(page);
+  else
+    --_frames[page].refCount;
+}
+
+void Memory::unrefPages(page_t first, std::size_t count)
+{
+  assert(_frames && first + count <= _freeFrames.size());
+
+  auto _ = _lock.getScoped();
+
+  for (page_t page = first; page < first + count; ++page)
+  {
+    assert(_frames[page].refCount && "Unreferencing a free frame");
+    if (_frames[page].refCount == 1)
+      setPageFreeLocked(page);
+    else
+      --_frames[page].refCount;
+  }
+}
+
+bool Memory::isReserved(page_t page)
+{
+  if (page >= _freeFrames.size())
+    return true;
+
+  auto _ = _lock.getScoped();
+
+  if (_frames)
+    return _frames[page].flags & FRAME_RESERVED;
+
+  for (const auto& range : _usableRanges)
+    if (page >= range.first && page < range.second)
+      return false;
+  return true;
 }
@@ -2,28 +2,158 @@
 #define MEMORY_HPP
 
 #include <vector>
+#include <utility>
 
+#include "HierarchicalBitmap.hpp"
+#include "SpinLock.hpp"
 #include "Types.hpp"
 
 class Memory
 {
 public:
+  struct Frame
+  {
+    /// Number of owners of the frame, 0 when it is free
+    uint16_t refCount;
+    uint8_t flags;
+  };
+
+  /// The frame is not usable RAM (firmware, memory hole, etc)
+  static constexpr uint8_t FRAME_RESERVED = 1 << 0;
+
+  /// Number of recently freed frames kept aside for getFreePage()
+  static constexpr std::size_t HotFrameCapacity = 32;
+  /// Number of frames given back to the frame map when the cache is full
+  static constexpr std::size_t HotFrameDrainCount = HotFrameCapacity / 2;
+
+  /** Function giving back cached pages, called when memory is exhausted
+   *
+   * \return the number of pages it freed
+   */
+  using ReclaimHandler = std::size_t (*)(void* data);
+
+  static constexpr std::size_t MaxReclaimHandlers = 4;
+
+  /** Number of frames the frame map can cover, 32GB of RAM
+   *
+   * The map is allocated on the 2MB premapped heap with a bit per frame, this
+   * keeps it to 1MB so that the other early allocations still fit.
+   */
+  static constexpr page_t MaxFrameCount = 0x800000;
+
   static Memory& get();
 
+  /** Allocate the frame map for frames 0 to \p frameCount, all used
+   *
+   * \p frameCount must not exceed MaxFrameCount. Must be called once, before
+   * any other method. Usable memory must then be
+   * declared with addUsableRange(), everything else stays reserved.
+   */
+  void init(page_t frameCount);
+  /// Declare frames from \p from to \p to as usable RAM and mark them free
+  void addUsableRange(page_t from, page_t to);
+  /** Allocate the per-frame database
+   *
+   * The database is too large for the premapped heap, so it must be called
+   * once the kernel heap can map pages. Until then, only the frame map is
+   * maintained.
+   */
+  void initFrameDatabase();
+  /// Call \p handler with \p data to reclaim memory before failing
+  void addReclaimHandler(ReclaimHandler handler, void* data);
+
+  /** Get a free page
+   *
+   * The most recently freed frames are handed out first, while they may still
+   * be in the CPU caches. If there is no free page, the reclaim handlers are
+   * called before giving up.
+   */
   page_t getFreePage();
+  /** Get \p count physically contiguous free pages
+   *
+   * \param alignment alignment of the first page, in pages, must be a power of
+   * 2
+   * \return the first page, or INVALID_PAGE if there is no such range, even
+   * after calling the reclaim handlers
+   */
+  page_t getFreePages(std::size_t count, std::size_t alignment = 1);
   void setPageFree(page_t page);
+  /** Free \p count pages starting at \p first
+   *
+   * The range is given back to the frame map directly so that it can be
+   * allocated contiguously again.
+   */
+  void setPagesFree(page_t first, std::size_t count);
+  /// Mark \p page as used, pages past the end of memory are ignored
   void setPageUsed(page_t page);
   void setRangeUsed(page_t from, page_t to);
+  /// Mark pages from \p from to \p to as used, whatever their state
   void completeRangeUsed(page_t from, page_t to);
 
+  uint16_t getRefCount(page_t page);
+  /// Add an owner to used \p page
+  void refPage(page_t page);
+  /// Remove an owner from \p page and free it if it was the last one
+  void unrefPage(page_t page);
+  /** Remove an owner from \p count pages starting at \p first
+   *
+   * Like setPagesFree(), the freed pages skip the hot frames and go to the
+   * frame map, so that a large page can be allocated there again.
+   */
+  void unrefPages(page_t first, std::size_t count);
+  bool isReserved(page_t page);
+
   uint64_t getUsedPageCount() const
   {
     return _usedPageCount;
   }
+  page_t getFrameCount() const
+  {
+    return _freeFrames.size();
+  }
+  /// Usable RAM ranges, as declared with addUsableRange()
+  const std::vector<std::pair<page_t, page_t>>& getUsableRanges() const
+  {
+    return _usableRanges;
+  }
+  std::size_t getHotFrameCount() const
+  {
+    return _hotFrameCount;
+  }
 
 private:
-  std::vector<bool> _frames;
+  SpinLock _lock;
+  /// Bit set means the frame is free
+  HierarchicalBitmap _freeFrames;
   uint64_t _usedPageCount = 0;
+
+  /// Usable RAM, as declared by the memory map
+  std::vector<std::pair<page_t, page_t>> _usableRanges;
+  /// Frame database, nullptr until initFrameDatabase() is called
+  Frame* _frames = nullptr;
+
+  /** LIFO of free frames which are still clear in _freeFrames
+   *
+   * They are free for accounting and in the frame database, but only
+   * getFreePage() takes them.
+   */
+  page_t _hotFrames[HotFrameCapacity];
+  std::size_t _hotFrameCount = 0;
+
+  std::pair<ReclaimHandler, void*> _reclaimHandlers[MaxReclaimHandlers];
+  std::size_t _reclaimHandlerCount = 0;
+
+  /// Call the reclaim handlers, return true if some pages were freed
+  bool reclaim();
+  /// Return INVALID_PAGE if there is no free page
+  page_t getFreePageLocked();
+  page_t getFreePagesLocked(std::size_t count, std::size_t alignment);
+  void setPageUsedLocked(page_t page);
+  void setPageFreeLocked(page_t page);
+  /// Release a page, through the hot frame cache
+  void releasePageLocked(page_t page);
+  /// Give back the \p count oldest hot frames to the frame map
+  void drainHotFramesLocked(std::size_t count);
 };
 
 #endif /* MEMORY_HPP */
@@ -17,22 +17,35 @@ void MultibootLoader::handle(void* vmboot, bool mem)
   //TagsHeader* header = reinterpret_cast<TagsHeader*>(vmboot);
 
   char* mboot = reinterpret_cast<char*>(vmboot);
-  bool memFound = false;
+  Tag* const firstTag = reinterpret_cast<Tag*>(mboot + sizeof(TagsHeader));
 
-  for (Tag* tag = reinterpret_cast<Tag*>(mboot + sizeof(TagsHeader));
+  if (mem)
+  {
+    // the memory map sizes the frame map, it must be handled before any tag
+    // marks pages as used
+    bool memFound = false;
+    for (Tag* tag = firstTag;
+        tag->type != 0;
+        tag = ptrAlignSup(ptrAdd(tag, tag->size), 8))
+      if (tag->type == 6)
+      {
+        if (memFound)
+          PANIC("More than one memory tag in multiboot information");
+        memFound = true;
+        prehandleMemoryMap(reinterpret_cast<MemoryMap*>(tag));
+      }
+
+    if (!memFound)
+      PANIC("Memory tag not found in multiboot information");
+  }
+
+  for (Tag* tag = firstTag;
       tag->type != 0;
       tag = ptrAlignSup(ptrAdd(tag, tag->size), 8))
     if (mem)
-    {
-      if (tag->type == 6)
-        memFound = true;
       prehandleTag(tag);
-    }
     else
       handleTag(tag);
-
-  if (mem && !memFound)
-    PANIC("Memory tag not found in multiboot information");
 }
 
 void MultibootLoader::prehandleTag(Tag* tag)
@@ -42,9 +55,6 @@ void MultibootLoader::prehandleTag(Tag* tag)
     case 3:
       prehandleModule(reinterpret_cast<Module*>(tag));
       break;
-    case 6:
-      prehandleMemoryMap(reinterpret_cast<MemoryMap*>(tag));
-      break;
   }
 }
 
@@ -106,26 +116,47 @@ void MultibootLoader::prehandleMemoryMap(MemoryMap* map)
       reinterpret_cast<char*>(map)+sizeof(MemoryMap));
   MemoryMapEntry* end = ptrAdd(entry, map->size);
 
-  while (ptrAdd(entry, map->entry_size) < end)
-  {
-    handleMemoryMapEntry(entry);
+  // the frame map covers memory up to the end of the highest usable chunk
+  uint64_t memoryEnd = 0;
+  for (MemoryMapEntry* cur = entry;
+      ptrAdd(cur, map->entry_size) < end;
+      cur = ptrAdd(cur, map->entry_size))
+    if (cur->type == 1)
+      memoryEnd = std::max(memoryEnd, cur->base_addr + cur->length);
 
-    entry = ptrAdd(entry, map->entry_size);
+  xDeb("Memory ends at %x", memoryEnd);
+  if (memoryEnd / PAGE_SIZE > Memory::MaxFrameCount)
+  {
+    xWar("Ignoring memory above %x", Memory::MaxFrameCount * PAGE_SIZE);
+    memoryEnd = Memory::MaxFrameCount * PAGE_SIZE;
   }
+  Memory::get().init(memoryEnd / PAGE_SIZE);
+
+  // everything starts used, free usable chunks first and then reserve the
+  // others in case they overlap
+  for (bool usable : {true, false})
+    for (MemoryMapEntry* cur = entry;
+        ptrAdd(cur, map->entry_size) < end;
+        cur = ptrAdd(cur, map->entry_size))
+      if ((cur->type == 1) == usable)
+        handleMemoryMapEntry(cur);
 }
 
 void MultibootLoader::handleMemoryMapEntry(MemoryMapEntry* entry)
 {
-  // if the segment is free to use, skip it
+  const uint64_t entryEnd = entry->base_addr + entry->length;
+
   if (entry->type == 1)
+  {
+    // only whole pages can be used
+    Memory::get().addUsableRange(
+        intAlignSup(entry->base_addr, PAGE_SIZE) / PAGE_SIZE,
+        entryEnd / PAGE_SIZE);
     return;
+  }
 
-  xDeb("Reserved memory chunk: %x-%x", entry->base_addr,
-      entry->base_addr + entry->length);
+  xDeb("Reserved memory chunk: %x-%x", entry->base_addr, entryEnd);
 
-  for (uint64_t page = entry->base_addr / 0x1000,
-      lastPage = page + (entry->length + 0xFFF) / 0x1000;
-      page < lastPage;
-      ++page)
-    Memory::get().setPageUsed(page);
+  Memory::get().completeRangeUsed(entry->base_addr / PAGE_SIZE,
+      intAlignSup(entryEnd, PAGE_SIZE) / PAGE_SIZE);
 }
@@ -0,0 +1,198 @@
+#ifndef OBJECT_CACHE_HPP
+#define OBJECT_CACHE_HPP
+
+#include <cstdint>
+#include <cstddef>
+#include <new>
+#include <utility>
+
+#include "KHeap.hpp"
+#include "SpinLock.hpp"
+
+/**
+ * Cache of storage for objects of type \p T
+ *
+ * Freed objects are destroyed but their storage is kept in a free list, up to
+ * MaxCachedCount of them, and handed out again on the next allocation without
+ * going through the general heap.
+ *
+ * Only storage is kept, not constructed objects. The cached types are
+ * container nodes, which the containers construct themselves, and file
+ * handles, which are built from the inode they open. Their constructors only
+ * move or copy a few pointers. The costly parts of a task (its page directory
+ * and kernel stack) are built before its node exists and are recycled by
+ * their own PageHeap.
+ *
+ * There is one cache per type, get it with get().
+ */
+template <typename T>
+class ObjectCache
+{
+public:
+  struct Stats
+  {
+    /// Objects currently allocated from the cache
+    uint64_t liveCount;
+    /// Free storage kept for reuse
+    uint64_t cachedCount;
+    /// Allocations served from the free list
+    uint64_t hitCount;
+    /// Allocations that went to the heap
+    uint64_t missCount;
+  };
+
+  static constexpr std::size_t MaxCachedCount = 64;
+
+  static ObjectCache& get()
+  {
+    static ObjectCache cache;
+    return cache;
+  }
+
+  ObjectCache() = default;
+  ObjectCache(const ObjectCache&) = delete;
+  ObjectCache& operator=(const ObjectCache&) = delete;
+
+  template <typename... Args>
+  T* create(Args&&... args)
+  {
+    return new (allocate()) T(std::forward<Args>(args)...);
+  }
+
+  void destroy(T* object)
+  {
+    if (!object)
+      return;
+
+    object->~T();
+    deallocate(object);
+  }
+
+  /// Get uninitialized storage for a T
+  void* allocate()
+  {
+    {
+      auto lock = m_lock.getScoped();
+
+      ++m_stats.liveCount;
+      if (FreeSlot* slot = m_freeSlots)
+      {
+        m_freeSlots = slot->next;
+        --m_stats.cachedCount;
+        ++m_stats.hitCount;
+        return slot;
+      }
+      ++m_stats.missCount;
+    }
+
+    return KHeap::get().kmallocAligned(SlotSize, alignof(T));
+  }
+
+  /// Give back storage obtained with allocate()
+  void deallocate(void* ptr)
+  {
+    {
+      auto lock = m_lock.getScoped();
+
+      --m_stats.liveCount;
+      if (m_stats.cachedCount < MaxCachedCount)
+      {
+        FreeSlot* slot = static_cast<FreeSlot*>(ptr);
+        slot->next = m_freeSlots;
+        m_freeSlots = slot;
+        ++m_stats.cachedCount;
+        return;
+      }
+    }
+
+    KHeap::get().kfree(ptr, SlotSize);
+  }
+
+  Stats getStats()
+  {
+    auto lock = m_lock.getScoped();
+    return m_stats;
+  }
+
+private:
+  struct FreeSlot
+  {
+    FreeSlot* next;
+  };
+
+  static constexpr std::size_t SlotSize =
+    sizeof(T) > sizeof(FreeSlot) ? sizeof(T) : sizeof(FreeSlot);
+
+  SpinLock m_lock;
+  FreeSlot* m_freeSlots = nullptr;
+  Stats m_stats{};
+};
+
+/**
+ * Allocator for standard containers which takes single objects from their
+ * ObjectCache
+ *
+ * Node based containers allocate nodes one by one, so they always hit the
+ * cache of their node type. Arrays go to the general heap.
+ */
+template <typename T>
+class CacheAllocator
+{
+public:
+  using value_type = T;
+
+  CacheAllocator() = default;
+  template <typename U>
+  CacheAllocator(const CacheAllocator<U>&)
+  {}
+
+  T* allocate(std::size_t n)
+  {
+    if (n == 1)
+      return static_cast<T*>(ObjectCache<T>::get().allocate());
+    return static_cast<T*>(
+        KHeap::get().kmallocAligned(n * sizeof(T), alignof(T)));
+  }
+
+  void deallocate(T* ptr, std::size_t n)
+  {
+    if (n == 1)
+      ObjectCache<T>::get().deallocate(ptr);
+    else
+      KHeap::get().kfree(ptr, n * sizeof(T));
+  }
+};
+
+template <typename T, typename U>
+bool operator==(const CacheAllocator<T>&, const CacheAllocator<U>&)
+{
+  return true;
+}
+
+template <typename T, typename U>
+bool operator!=(const CacheAllocator<T>&, const CacheAllocator<U>&)
+{
+  return false;
+}
+
+/**
+ * Base class making dynamic allocations of \p T go through its ObjectCache
+ *
+ * Use it for polymorphic objects created with new, like file handles.
+ */
+template <typename T>
+struct CachedAllocation
+{
+  static void* operator new(std::size_t size)
+  {
+    assert(size == sizeof(T) && "Allocating a derived class of a cached type");
+    (void)size;
+    return ObjectCache<T>::get().allocate();
+  }
+  static void operator delete(void* ptr)
+  {
+    ObjectCache<T>::get().deallocate(ptr);
+  }
+};
+
+#endif /* OBJECT_CACHE_HPP */
@@ -2,6 +2,8 @@
 #include "KHeap.hpp"
 #include "Symbols.hpp"
 #include "Memory.hpp"
+#include "ZeroedPagePool.hpp"
+#include "SpinLock.hpp"
 #include "Util.hpp"
 #include "Debug.hpp"
 
@@ -9,10 +11,95 @@ XLL_LOG_CATEGORY("core/memory/pagedirectory");
 
 PageDirectory* PageDirectory::g_kernelDirectory = nullptr;
 
+/// Number of process-context identifiers, PCID 0 is kept for the kernel
+static constexpr uint16_t PCID_COUNT = 4096;
+/// Bit 63 of CR3, keep the TLB entries of the loaded PCID
+static constexpr uint64_t CR3_NOFLUSH = 1ull << 63;
+
+static bool g_pcidEnabled = false;
+static bool g_invpcidSupported = false;
+
+static SpinLock g_pcidLock;
+static uint64_t g_usedPcids[PCID_COUNT / 64] = {1};
+/// PCIDs that were freed without being invalidated
+static uint64_t g_stalePcids[PCID_COUNT / 64] = {};
+static uint16_t g_nextPcid = 1;
+
+/** Allocate a PCID
+ *
+ * Returns 0 when they are all used, the directory then flushes the TLB each
+ * time it is loaded. \p stale is set if the TLB may still have entries of a
+ * previous owner.
+ */
+static uint16_t allocatePcid(bool& stale)
+{
+  auto lock = g_pcidLock.getScoped();
+
+  for (uint16_t i = 0; i < PCID_COUNT - 1; ++i)
+  {
+    const uint16_t pcid = g_nextPcid;
+    g_nextPcid = g_nextPcid == PCID_COUNT - 1 ? 1 : g_nextPcid + 1;
+
+    const uint64_t bit = 1ull << (pcid % 64);
+    if (g_usedPcids[pcid / 64] & bit)
+      continue;
+
+    g_usedPcids[pcid / 64] |= bit;
+    stale = g_stalePcids[pcid / 64] & bit;
+    g_stalePcids[pcid / 64] &= ~bit;
+    return pcid;
+  }
+
+  xWar("No PCID left, falling back to full TLB flushes");
+  return 0;
+}
+
+static void freePcid(uint16_t pcid)
+{
+  assert(pcid);
+
+  const uint64_t bit = 1ull << (pcid % 64);
+
+  if (g_invpcidSupported)
+    Cpu::invpcid(Cpu::INVPCID_CONTEXT, pcid);
+
+  auto lock = g_pcidLock.getScoped();
+
+  assert(g_usedPcids[pcid / 64] & bit);
+  g_usedPcids[pcid / 64] &= ~bit;
+  if (!g_invpcidSupported)
+    g_stalePcids[pcid / 64] |= bit;
+}
+
+/** Tell if \p vaddr is mapped the same way in all page directories
+ *
+ * These pages are marked global, they stay in the TLB when switching address
+ * space and invlpg invalidates them whatever the current PCID is.
+ */
+static bool isSharedKernelAddress(const void* vaddr)
+{
+  const uintptr_t addr = reinterpret_cast<uintptr_t>(vaddr);
+  // the physical memory map has the whole PML4 entry
+  return addr >= reinterpret_cast<uintptr_t>(Symbols::getKernelVBase()) ||
+    (addr >= PageDirectory::PHYSMAP_BASE &&
+     addr < PageDirectory::PHYSMAP_BASE + 512 * PageDirectory::HUGE_PAGE_SIZE);
+}
+
 PageDirectory* PageDirectory::initKernelDirectory()
 {
   // enable NXE
   Cpu::writeMsr(Cpu::MSR_EFER, Cpu::readMsr(Cpu::MSR_EFER) | 1 << 11);
+  Cpu::enableGlobalPages();
+
+  // the boot CR3 has PCID 0, as required to enable them
+  if (!g_pcidEnabled && Cpu::hasPcid())
+  {
+    Cpu::enablePcid();
+    g_pcidEnabled = true;
+    g_invpcidSupported = Cpu::hasInvpcid();
+    xInf("PCID enabled, invpcid %s",
+        g_invpcidSupported ? "supported" : "not supported");
+  }
 
   if (!g_kernelDirectory)
   {
@@ -22,6 +109,9 @@ PageDirectory* PageDirectory::initKernelDirectory()
   return g_kernelDirectory;
 }
 
+/// End of the physical memory map, 0 until it is initialized
+static physaddr_t g_physmapEnd = 0;
+
 template <unsigned Attr>
 static const auto AttributeSetter = [](auto& e) {
   if (Attr & PageDirectory::ATTR_RW)
@@ -52,13 +142,63 @@ void PageDirectory::mapKernel()
   m_manager->mapTo<2>(*getKernelDirectory()->m_manager,
       Symbols::getKernelVBase(),
       AttributeSetter<ATTR_RW>);
+  // the physical memory map has its own PML4 entry, share it whole
+  m_manager->mapTo<3>(*getKernelDirectory()->m_manager,
+      reinterpret_cast<void*>(PHYSMAP_BASE),
+      AttributeSetter<ATTR_RW>);
 
   m_manager->getEntry<3>(reinterpret_cast<void*>(0xffffffff00000000))->us = 1;
 }
 
-#ifndef NDEBUG
+/// Set on the first use(), the page pool can be refilled from then on
 static bool g_pagingReady = false;
-#endif
+
+void PageDirectory::initPhysmap()
+{
+  assert(g_pagingReady);
+  assert(!g_physmapEnd && "Physical memory map initialized twice");
+
+  auto& kernelDirectory = *getKernelDirectory();
+
+  for (const auto& range : Memory::get().getUsableRanges())
+  {
+    const physaddr_t from = range.first * PAGE_SIZE;
+    const physaddr_t to = range.second * PAGE_SIZE;
+
+    xDeb("Mapping physical memory %x-%x", from, to);
+
+    // the edges of the range are mapped with 4KB pages so that no reserved
+    // or MMIO frame gets a write-back mapping
+    kernelDirectory.mapRangeTo(reinterpret_cast<char*>(PHYSMAP_BASE + from),
+        reinterpret_cast<char*>(PHYSMAP_BASE + to), from,
+        ATTR_RW | ATTR_NOEXEC);
+
+    g_physmapEnd = std::max(g_physmapEnd, to);
+  }
+
+  // directories were allocated with the page heap
+  getPdPageHeap().refillPool();
+}
+
+void* PageDirectory::physToVirt(physaddr_t paddr)
+{
+  assert(paddr < g_physmapEnd && "Physical address is not in the physmap");
+
+  return reinterpret_cast<char*>(PHYSMAP_BASE + paddr);
+}
+
+physaddr_t PageDirectory::virtToPhys(const void* vaddr)
+{
+  const auto addr = reinterpret_cast<uintptr_t>(vaddr);
+  if (addr >= PHYSMAP_BASE && addr < PHYSMAP_BASE + g_physmapEnd)
+    return addr - PHYSMAP_BASE;
+
+  const physaddr_t page =
+    getCurrent()->resolve(reinterpret_cast<void*>(addr & ~(PAGE_SIZE - 1)));
+  if (page == INVALID_PHYS)
+    return INVALID_PHYS;
+  return page + addr % PAGE_SIZE;
+}
 
 void PageDirectory::initWithDefaultPaging()
 {
@@ -66,7 +206,8 @@ void PageDirectory::initWithDefaultPaging()
 
   xDeb("Mapping VGA");
   _mapPageTo(Symbols::getKernelVVga(), 0xB8000, ATTR_RW);
-  Memory::get().setPageUsed(0xB8000 / 0x1000);
+  // VGA memory is not usable RAM, but be safe if the memory map says so
+  Memory::get().completeRangeUsed(0xB8000 / 0x1000, 0xB9000 / 0x1000);
 
 #define MAP_RANGE(name, from, to, phys, attr)         \
   xDeb("Mapping " name " (size: %x)", (to) - (from)); \
@@ -118,22 +259,44 @@ void PageDirectory::use()
 {
   xDeb("Changing pagetable to %x", m_directory.value);
 
-#ifndef NDEBUG
   if (g_pagingReady)
   {
+#ifndef NDEBUG
     int var;
     // check that we keep the same stack before and after the change
-    assert((!g_pagingReady || getCurrent()->resolve(&var) == resolve(&var)) &&
+    assert(getCurrent()->resolve(&var) == resolve(&var) &&
         "Changing page directory would mess up the stack!");
+#endif
   }
   else
     g_pagingReady = true;
-#endif
 
-  asm volatile("mov %0, %%cr3":: "r"(m_directory.value));
+  uint64_t cr3 = m_directory.value;
+  // the kernel directory is only used during boot, it keeps PCID 0
+  if (g_pcidEnabled && this != g_kernelDirectory)
+  {
+    if (!m_pcid)
+      m_pcid = allocatePcid(m_pcidStale);
+
+    cr3 |= m_pcid;
+    // without a PCID of our own, entries of PCID 0 may belong to anyone
+    if (m_pcid && !m_pcidStale)
+      cr3 |= CR3_NOFLUSH;
+    m_pcidStale = false;
+  }
+
+  asm volatile("mov %0, %%cr3":: "r"(cr3));
   g_currentPageDirectory = this;
 }
 
+void PageDirectory::releasePcid()
+{
+  if (m_pcid)
+    freePcid(m_pcid);
+  m_pcid = 0;
+  m_pcidStale = false;
+}
+
 PageDirectory* PageDirectory::getCurrent()
 {
   return g_currentPageDirectory;
@@ -149,16 +312,21 @@ void PageDirectory::mapPageTo(void* vaddr, physaddr_t paddr, uint8_t attributes)
   getPdPageHeap().refillPool();
 }
 
-void PageDirectory::_mapPageTo(void* vaddr, physaddr_t paddr, uint8_t attributes)
+static void checkAttributes(void* vaddr, uint8_t attributes)
 {
   // we consider everything above 0xffffffff00000000 is kernel space, but
   // everything up to 0xffffffffc0000000 is process-specific
   if (reinterpret_cast<uintptr_t>(vaddr) < 0xffffffff00000000 &&
-      !(attributes & ATTR_PUBLIC))
+      !(attributes & PageDirectory::ATTR_PUBLIC))
     PANIC("Mapping private page in user space");
   if (reinterpret_cast<uintptr_t>(vaddr) > 0xffffffffc0000000 &&
-      (attributes & ATTR_PUBLIC))
+      (attributes & PageDirectory::ATTR_PUBLIC))
     PANIC("Mapping public page in kernel space");
+}
+
+void PageDirectory::_mapPageTo(void* vaddr, physaddr_t paddr, uint8_t attributes)
+{
+  checkAttributes(vaddr, attributes);
 
   switch (attributes)
   {
@@ -196,34 +364,163 @@ void PageDirectory::mapPageToF(void* vaddr, physaddr_t paddr, const F& f)
   PageTableEntry* page = m_manager->getPage(vaddr, AttributeSetter<0x3>);
   assert(!page->p && "Page already mapped");
   page->p = true;
+  page->g = isSharedKernelAddress(vaddr);
   page->base = paddr >> BASE_SHIFT;
   f(*page);
 }
 
+template <typename F>
+void PageDirectory::mapPagesF(char* vastart, char* vaend, const F& f)
+{
+  while (vastart < vaend)
+  {
+    PageTableEntry* page = m_manager->getPage(vastart, AttributeSetter<0x3>);
+    if (g_pagingReady)
+      getPdPageHeap().refillPool();
+
+    // the entries of a page table are contiguous, fill them up to the end of
+    // the table without walking the tree again
+    char* const tableEnd = reinterpret_cast<char*>(intAlignSup(
+          reinterpret_cast<uintptr_t>(vastart) + 1, LARGE_PAGE_SIZE));
+    for (char* const end = std::min(vaend, tableEnd);
+        vastart < end;
+        vastart += PAGE_SIZE, ++page)
+    {
+      assert(!page->p && "Page already mapped");
+      *page = PageTableEntry{};
+      page->g = isSharedKernelAddress(vastart);
+      f(*page, vastart);
+    }
+  }
+}
+
+template <unsigned Level>
+void PageDirectory::mapLargePageTo(void* vaddr, physaddr_t paddr,
+    uint8_t attributes)
+{
+  static constexpr uintptr_t Size = PAGE_SIZE << (9 * Level);
+
+  xDeb("Mapping large page %p to %x (size: %x)", vaddr, paddr, Size);
+
+  assert(reinterpret_cast<uintptr_t>(vaddr) % Size == 0 && paddr % Size == 0 &&
+      "Large page is not aligned");
+
+  PageTableEntry* entry =
+    m_manager->getEntry<Level>(vaddr, AttributeSetter<0x3>);
+  assert(!entry->p && "Page already mapped");
+  entry->p = true;
+  entry->rw = !!(attributes & ATTR_RW);
+  entry->us = !!(attributes & ATTR_PUBLIC);
+  entry->nx = !!(attributes & ATTR_NOEXEC);
+  entry->g = isSharedKernelAddress(vaddr);
+  // this is the PS bit in a directory entry
+  entry->pat = true;
+  entry->base = paddr >> BASE_SHIFT;
+}
+
+void PageDirectory::mapDeferredLargePage(void* vaddr, uint8_t attributes)
+{
+  assert(g_pagingReady);
+  assert(reinterpret_cast<uintptr_t>(vaddr) < 0xffffffff00000000 &&
+      "Deferred large pages are for userspace");
+
+  assert(reinterpret_cast<uintptr_t>(vaddr) % LARGE_PAGE_SIZE == 0 &&
+      "Large page is not aligned");
+
+  xDeb("Mapping deferred large page %p", vaddr);
+
+  PageDirectoryEntry* entry =
+    m_manager->getEntry<1>(vaddr, AttributeSetter<0x3>);
+  assert(!entry->p && "Page already mapped");
+  entry->rw = !!(attributes & ATTR_RW);
+  entry->us = !!(attributes & ATTR_PUBLIC);
+  entry->nx = !!(attributes & ATTR_NOEXEC);
+  entry->pat = true;
+  entry->base = INVALID_PAGE;
+
+  getPdPageHeap().refillPool();
+}
+
 void PageDirectory::mapRangeTo(void* vvastart, void* vvaend, physaddr_t pastart,
     uint8_t attributes)
 {
   char* vastart = static_cast<char*>(vvastart);
   char* vaend = static_cast<char*>(vvaend);
 
+  const bool hugePages = Cpu::has1GbPages();
+  const auto fits = [&](uintptr_t size) {
+    return reinterpret_cast<uintptr_t>(vastart) % size == 0 &&
+      pastart % size == 0 &&
+      static_cast<uintptr_t>(vaend - vastart) >= size;
+  };
+  // a large page can't take the place of an existing table
+  const auto isFree = [](const PageTableEntry* entry) {
+    return !entry || !entry->p;
+  };
+
   while (vastart < vaend)
   {
-    _mapPageTo(vastart, pastart, attributes);
-
-    vastart += 0x1000;
-    pastart += 0x1000;
+    if (hugePages && fits(HUGE_PAGE_SIZE) &&
+        isFree(m_manager->getEntry<2>(vastart)))
+    {
+      mapLargePageTo<2>(vastart, pastart, attributes);
+      vastart += HUGE_PAGE_SIZE;
+      pastart += HUGE_PAGE_SIZE;
+    }
+    else if (fits(LARGE_PAGE_SIZE) && isFree(m_manager->getEntry<1>(vastart)))
+    {
+      mapLargePageTo<1>(vastart, pastart, attributes);
+      vastart += LARGE_PAGE_SIZE;
+      pastart += LARGE_PAGE_SIZE;
+    }
+    else
+    {
+      // 4KB pages up to where a large page may fit
+      char* const end = std::min(vaend, reinterpret_cast<char*>(intAlignSup(
+              reinterpret_cast<uintptr_t>(vastart) + 1, LARGE_PAGE_SIZE)));
+      checkAttributes(vastart, attributes);
+      mapPagesF(vastart, end, [&](PageTableEntry& e, char* vaddr) {
+            e.p = !(attributes & ATTR_DEFER);
+            e.rw = !!(attributes & ATTR_RW);
+            e.us = !!(attributes & ATTR_PUBLIC);
+            e.nx = !!(attributes & ATTR_NOEXEC);
+            e.base = (pastart + (vaddr - vastart)) >> BASE_SHIFT;
+          });
+      pastart += end - vastart;
+      vastart = end;
+    }
   }
 }
 
 void PageDirectory::mapRange(void* vvastart, void* vvaend, uint8_t attributes)
 {
-  for (char* vastart = static_cast<char*>(vvastart),
-             * vaend = static_cast<char*>(vvaend);
-       vastart < vaend;
-       vastart += PAGE_SIZE)
-  {
-    mapPage(vastart, attributes);
-  }
+  assert(g_pagingReady);
+
+  char* const vastart = reinterpret_cast<char*>(
+      reinterpret_cast<uintptr_t>(vvastart) & ~(PAGE_SIZE - 1));
+  char* const vaend = reinterpret_cast<char*>(
+      intAlignSup(reinterpret_cast<uintptr_t>(vvaend), PAGE_SIZE));
+
+  xDeb("Mapping range %p-%p", vastart, vaend);
+
+  checkAttributes(vastart, attributes);
+  mapPagesF(vastart, vaend, [&](PageTableEntry& e, char*) {
+        e.p = !(attributes & ATTR_DEFER);
+        e.rw = !!(attributes & ATTR_RW);
+        e.us = !!(attributes & ATTR_PUBLIC);
+        e.nx = !!(attributes & ATTR_NOEXEC);
+
+        if (!e.p)
+          e.base = INVALID_PHYS >> BASE_SHIFT;
+        else
+        {
+          const page_t page = (attributes & ATTR_ZERO) ?
+            ZeroedPagePool::get().getPage() :
+            Memory::get().getFreePage();
+          assert(page != INVALID_PAGE);
+          e.base = page;
+        }
+      });
 }
 
 void PageDirectory::mapPage(void* vaddr, uint8_t attributes, physaddr_t* paddr)
@@ -236,12 +533,14 @@ void PageDirectory::mapPage(void* vaddr, uint8_t attributes, physaddr_t* paddr)
     target = INVALID_PHYS;
   else
   {
-    page_t page = Memory::get().getFreePage();
+    page_t page = (attributes & ATTR_ZERO) ?
+      ZeroedPagePool::get().getPage() :
+      Memory::get().getFreePage();
     assert(page != INVALID_PAGE);
     target = page * PAGE_SIZE;
   }
 
-  mapPageTo(vaddr, target, attributes);
+  mapPageTo(vaddr, target, attributes & ~ATTR_ZERO);
   if (paddr)
     *paddr = target;
 }
@@ -256,11 +555,80 @@ physaddr_t PageDirectory::unmapPage(void* vaddr)
   const auto base = page->base;
   page->base = 0;
 
-  asm volatile("invlpg %0" ::"m"(*(char*)vaddr));
+  invalidatePage(vaddr);
 
   return base << BASE_SHIFT;
 }
 
+void PageDirectory::unmapRange(void* vvastart, void* vvaend,
+    const std::function<void(physaddr_t)>& f)
+{
+  assert(g_pagingReady);
+
+  char* vastart = static_cast<char*>(vvastart);
+  char* const vaend = static_cast<char*>(vvaend);
+
+  xDeb("Unmapping range %p-%p", vastart, vaend);
+
+  while (vastart < vaend)
+  {
+    PageTableEntry* page = m_manager->getPage(vastart);
+    assert(page && "Unmapping page that was not mapped");
+
+    char* const tableEnd = reinterpret_cast<char*>(intAlignSup(
+          reinterpret_cast<uintptr_t>(vastart) + 1, LARGE_PAGE_SIZE));
+    for (char* const end = std::min(vaend, tableEnd);
+        vastart < end;
+        vastart += PAGE_SIZE, ++page)
+    {
+      assert(page->p && "Unmapping page that was not mapped");
+      page->p = false;
+      const physaddr_t phys = page->base << BASE_SHIFT;
+      page->base = 0;
+      if (f)
+        f(phys);
+    }
+  }
+
+  invalidateRange(vvastart, vvaend);
+}
+
+void PageDirectory::invalidatePage(void* vaddr)
+{
+  if (isSharedKernelAddress(vaddr) || this == g_currentPageDirectory)
+    asm volatile("invlpg %0" ::"m"(*(char*)vaddr));
+  else
+    // the PCID of this directory may still cache the page
+    m_pcidStale = true;
+}
+
+void PageDirectory::invalidateRange(void* vvastart, void* vvaend)
+{
+  char* const vastart = static_cast<char*>(vvastart);
+  char* const vaend = static_cast<char*>(vvaend);
+  const bool global = isSharedKernelAddress(vastart);
+
+  if (!global && this != g_currentPageDirectory)
+  {
+    m_pcidStale = true;
+    return;
+  }
+
+  if (static_cast<std::size_t>(vaend - vastart) / PAGE_SIZE >
+      INVALIDATE_PAGE_THRESHOLD)
+  {
+    // reloading CR3 keeps global pages
+    if (global)
+      Cpu::flushAllContexts();
+    else
+      flushTlb();
+    return;
+  }
+
+  for (char* vaddr = vastart; vaddr < vaend; vaddr += PAGE_SIZE)
+    asm volatile("invlpg %0" ::"m"(*vaddr));
+}
+
 void PageDirectory::unmapUserSpace()
 {
   xDeb("Unmapping userspace");
@@ -279,62 +647,112 @@ void PageDirectory::unmapUserSpace()
   xDeb("Marking pages as free");
   newPd.forEachUserPage([](PageTableEntry& e, void* addr, physaddr_t phys){
         xDeb("Unmapped %p", addr);
-
-        // deferred allocation
-        if (!e.p)
-        {
-          assert(phys == INVALID_PHYS);
-          return;
-        }
-
-        Memory::get().setPageFree(phys / PAGE_SIZE);
+        releaseUserFrames(e, phys);
       });
 }
 
-void PageDirectory::forEachUserPage(
-    const std::function<void(PageTableEntry&, void*, physaddr_t)>& f)
+void PageDirectory::unmapUserRange(void* vvastart, void* vvaend)
 {
-  for (auto& level4entry : *m_manager)
+  const uintptr_t vastart = reinterpret_cast<uintptr_t>(vvastart);
+  const uintptr_t vaend = reinterpret_cast<uintptr_t>(vvaend);
+
+  assert(vastart % PAGE_SIZE == 0 && vaend % PAGE_SIZE == 0);
+  assert(vastart < vaend && vaend <= USER_SPACE_END);
+
+  xDeb("Unmapping user range %p-%p", vvastart, vvaend);
+
+  // large pages crossing the bounds are cut in 4KB pages first
+  for (const uintptr_t bound : {vastart, vaend})
   {
-    const auto add4 =
-        extendSign(m_manager->getAddress(*std::get<0>(level4entry)));
-    auto level3 = *std::get<1>(level4entry);
-    if (!level3)
+    if (bound % LARGE_PAGE_SIZE == 0)
       continue;
 
-    for (auto& level3entry : *level3)
+    void* const page = reinterpret_cast<void*>(bound & ~(LARGE_PAGE_SIZE - 1));
+    PageDirectoryEntry* entry = m_manager->getEntry<1>(page);
+    if (!entry)
+      continue;
+    if (entry->isLargePage())
+      splitLargePage(page);
+    else if (entry->isDeferredLargePage())
     {
-      const auto add3 = level3->getAddress(*std::get<0>(level3entry));
-      // TODO make this constant more meaningful
-      if ((add4 | add3) >= 0xffff00000000)
-        continue;
-
-      auto level2 = *std::get<1>(level3entry);
-      if (!level2)
-        continue;
-
-      for (auto& level2entry : *level2)
-      {
-        const auto add2 = level2->getAddress(*std::get<0>(level2entry));
-        auto level1 = *std::get<1>(level2entry);
-        if (!level1)
-          continue;
-
-        for (auto& entry : *level1)
+      const uint8_t attributes = entry->getAttributes();
+      *entry = PageTableEntry{};
+      mapRange(page, static_cast<char*>(page) + LARGE_PAGE_SIZE, attributes);
+    }
+  }
+
+  m_manager->forEachEntry(vastart, vaend,
+      [](PageTableEntry& e, uintptr_t) {
+        releaseUserFrames(e, e.base << BASE_SHIFT);
+        e = PageTableEntry{};
+      });
+
+  m_manager->releaseEmpty(vastart, vaend);
+
+  // this also drops the cached directory entries of freed page tables
+  invalidateRange(vvastart, vvaend);
+}
+
+void PageDirectory::releaseUserFrames(PageTableEntry& e, physaddr_t phys)
+{
+  // deferred allocation
+  if (!e.p)
+  {
+    assert(phys == INVALID_PHYS);
+    return;
+  }
+
+  if (e.isLargePage())
+  {
+    Memory::get().unrefPages(phys / PAGE_SIZE, LARGE_PAGE_SIZE / PAGE_SIZE);
+    return;
+  }
+
+  // the frame may still be shared with another process
+  Memory::get().unrefPage(phys / PAGE_SIZE);
+}
+
+void PageDirectory::shareUserSpace(PageDirectory& target)
+{
+  xDeb("Sharing userspace copy-on-write");
+
+  // copy-on-write works on 4KB pages, a split page is not visited again
+  forEachUserPage([&](PageTableEntry& e, void* addr, physaddr_t){
+        if (e.isLargePage())
+          splitLargePage(addr);
+      });
+
+  forEachUserPage([&](PageTableEntry& e, void* addr, physaddr_t phys){
+        const uint8_t attributes = e.getAttributes();
+
+        if (e.isDeferredLargePage())
+        {
+          target.mapDeferredLargePage(addr, attributes & ~ATTR_DEFER);
+          return;
+        }
+
+        if (!e.p)
         {
-          if (!entry.isValid())
-            continue;
+          target.mapPage(addr, attributes);
+          return;
+        }
+
+        xDeb("Sharing %p, %x", addr, attributes);
 
-          const auto add1 = level1->getAddress(entry);
-          const auto fullAddr =
-              reinterpret_cast<void*>(add4 | add3 | add2 | add1);
-          const auto physAddr = entry.base << BASE_SHIFT;
+        Memory::get().refPage(phys / PAGE_SIZE);
 
-          f(entry, fullAddr, physAddr);
+        target.mapPageTo(addr, phys, attributes & ~ATTR_RW);
+        if (attributes & ATTR_RW)
+        {
+          e.rw = false;
+          e.avl |= PageTableEntry::AVL_COW;
+          target.m_manager->getPage(addr)->avl |= PageTableEntry::AVL_COW;
         }
-      }
-    }
-  }
+      });
+
+  // pages were made read-only here, stale writable entries must go
+  if (this == g_currentPageDirectory)
+    flushTlb();
 }
 
 physaddr_t PageDirectory::resolve(void* vaddr)
@@ -342,16 +760,50 @@ physaddr_t PageDirectory::resolve(void* vaddr)
   assert(g_pagingReady);
 
   PageTableEntry* page = m_manager->getPage(vaddr);
-  if (!page || !page->p)
+  if (!page)
+    return resolveLarge(vaddr);
+  if (!page->p)
     return INVALID_PHYS;
 
   return page->base << BASE_SHIFT;
 }
 
+physaddr_t PageDirectory::resolveLarge(void* vaddr)
+{
+  const auto addr = reinterpret_cast<uintptr_t>(vaddr);
+
+  PageTableEntry* entry = m_manager->getEntry<1>(vaddr);
+  uintptr_t size = LARGE_PAGE_SIZE;
+  if (!entry)
+  {
+    entry = m_manager->getEntry<2>(vaddr);
+    size = HUGE_PAGE_SIZE;
+  }
+
+  if (!entry || !entry->isLargePage())
+    return INVALID_PHYS;
+
+  return (entry->base << BASE_SHIFT) + (addr & (size - 1) & ~(PAGE_SIZE - 1));
+}
+
+static uint64_t g_deferredFaultCount = 0;
+
+uint64_t PageDirectory::getDeferredFaultCount()
+{
+  return g_deferredFaultCount;
+}
+
 bool PageDirectory::handleFault(void* vaddr)
 {
   PageTableEntry* entry = m_manager->getPage(vaddr);
-  if (!entry || entry->p || entry->base != INVALID_PAGE)
+  if (!entry)
+  {
+    if (!handleLargeFault(vaddr))
+      return false;
+    ++g_deferredFaultCount;
+    return true;
+  }
+  if (entry->p || entry->base != INVALID_PAGE)
   {
     if (entry)
       xDeb("Not a deferred allocation (p:%s base:%x)", (bool)entry->p,
@@ -361,12 +813,151 @@ bool PageDirectory::handleFault(void* vaddr)
     return false;
   }
 
-  page_t page = Memory::get().getFreePage();
+  ++g_deferredFaultCount;
+
+  // deferred pages are given to userspace, they must not leak old data
+  page_t page = ZeroedPagePool::get().getPage();
   entry->p = true;
   entry->base = page;
   xDeb("Handled deferred allocation, mapped %p to %x",
       vaddr, page << BASE_SHIFT);
 
+  // accesses are often sequential, map the neighbours before they fault.
+  // Entries of a page table are contiguous and the window does not cross
+  // one, they are not present so there is nothing to invalidate.
+  const std::size_t index =
+    (reinterpret_cast<uintptr_t>(vaddr) / PAGE_SIZE) % FAULT_AROUND_PAGES;
+  PageTableEntry* const window = entry - index;
+  for (std::size_t i = 0; i < FAULT_AROUND_PAGES; ++i)
+  {
+    PageTableEntry& neighbour = window[i];
+    if (neighbour.p || neighbour.base != INVALID_PAGE)
+      continue;
+
+    const page_t page = ZeroedPagePool::get().tryGetPage();
+    if (page == INVALID_PAGE)
+      break;
+    neighbour.p = true;
+    neighbour.base = page;
+  }
+
+  return true;
+}
+
+void PageDirectory::populateRange(void* vvastart, void* vvaend)
+{
+  const uintptr_t vastart = reinterpret_cast<uintptr_t>(vvastart);
+  const uintptr_t vaend = reinterpret_cast<uintptr_t>(vvaend);
+
+  xDeb("Populating %p-%p", vvastart, vvaend);
+
+  // large pages first, they may fall back to deferred 4KB pages which are
+  // populated next
+  m_manager->forEachEntry(vastart, vaend,
+      [&](PageTableEntry& e, uintptr_t addr) {
+        if (e.isDeferredLargePage())
+          handleLargeFault(reinterpret_cast<void*>(addr));
+      });
+  m_manager->forEachEntry(vastart, vaend,
+      [&](PageTableEntry& e, uintptr_t) {
+        if (e.p || e.pat || e.base != INVALID_PAGE)
+          return;
+        e.p = true;
+        e.base = ZeroedPagePool::get().getPage();
+      });
+}
+
+bool PageDirectory::handleLargeFault(void* vaddr)
+{
+  PageDirectoryEntry* entry = m_manager->getEntry<1>(vaddr);
+  if (!entry || !entry->isDeferredLargePage())
+  {
+    xDeb("Not a deferred allocation (no entry)");
+    return false;
+  }
+
+  char* const start = reinterpret_cast<char*>(
+      reinterpret_cast<uintptr_t>(vaddr) & ~(LARGE_PAGE_SIZE - 1));
+
+  const page_t page = Memory::get().getFreePages(
+      LARGE_PAGE_SIZE / PAGE_SIZE, LARGE_PAGE_SIZE / PAGE_SIZE);
+  if (page != INVALID_PAGE)
+  {
+    std::memset(physToVirt(page * PAGE_SIZE), 0, LARGE_PAGE_SIZE);
+    entry->p = true;
+    entry->base = page;
+    xDeb("Handled deferred large allocation, mapped %p to %x",
+        start, page << BASE_SHIFT);
+    return true;
+  }
+
+  xDeb("No contiguous memory for large page %p, using 4KB pages", start);
+
+  const uint8_t attributes = entry->getAttributes();
+  // the first mapping replaces the directory entry with a page table
+  for (char* page = start; page < start + LARGE_PAGE_SIZE; page += PAGE_SIZE)
+    mapPage(page, attributes);
+
+  // the access will fault again on a deferred 4KB page
+  return true;
+}
+
+void PageDirectory::splitLargePage(void* vaddr)
+{
+  PageDirectoryEntry* entry = m_manager->getEntry<1>(vaddr);
+  assert(entry && entry->isLargePage());
+
+  xDeb("Splitting large page %p", vaddr);
+
+  const physaddr_t phys = entry->base << BASE_SHIFT;
+  const uint8_t attributes = entry->getAttributes();
+  *entry = PageTableEntry{};
+
+  char* const start = static_cast<char*>(vaddr);
+  for (uintptr_t offset = 0; offset < LARGE_PAGE_SIZE; offset += PAGE_SIZE)
+    mapPageTo(start + offset, phys + offset, attributes);
+
+  // the large page may still be in the TLB
+  if (this == g_currentPageDirectory)
+    flushTlb();
+  else
+    m_pcidStale = true;
+}
+
+bool PageDirectory::handleWriteFault(void* vaddr)
+{
+  PageTableEntry* entry = m_manager->getPage(vaddr);
+  if (!entry || !entry->p || !entry->isCopyOnWrite())
+  {
+    xDeb("Not a copy-on-write page");
+    return false;
+  }
+
+  // the page is read through its user address
+  assert(this == g_currentPageDirectory);
+
+  auto& memory = Memory::get();
+  const page_t page = entry->base;
+  char* const pageAddr = reinterpret_cast<char*>(
+      reinterpret_cast<uintptr_t>(vaddr) & ~(PAGE_SIZE - 1));
+
+  // if the other owners are gone, the page can be made writable in place
+  if (memory.getRefCount(page) > 1)
+  {
+    const page_t newPage = memory.getFreePage();
+    std::memcpy(physToVirt(newPage * PAGE_SIZE), pageAddr, PAGE_SIZE);
+
+    entry->base = newPage;
+    memory.unrefPage(page);
+
+    xDeb("Copied %p from %x to %x", vaddr, page << BASE_SHIFT,
+        newPage << BASE_SHIFT);
+  }
+
+  entry->rw = true;
+  entry->avl &= ~PageTableEntry::AVL_COW;
+  invalidatePage(pageAddr);
+
   return true;
 }
 
@@ -375,18 +966,20 @@ bool PageDirectory::isPageMapped(void* vaddr)
   assert(g_pagingReady);
 
   PageTableEntry* page = m_manager->getPage(vaddr);
-  return page && page->p;
+  if (!page)
+    return resolveLarge(vaddr) != INVALID_PHYS;
+  return page->p;
 }
 
 std::optional<physaddr_t> PageDirectory::getPhysicalAddress(void* vaddr)
 {
   assert(g_pagingReady);
 
-  PageTableEntry* page = m_manager->getPage(vaddr);
-  if (!page || !page->p)
+  const physaddr_t phys = resolve(vaddr);
+  if (phys == INVALID_PHYS)
     return std::nullopt;
 
-  return page->base << BASE_SHIFT;
+  return phys;
 }
 
 // TODO make something to invalidate a single page (invlpg)
@@ -11,16 +11,37 @@ class PageDirectory
   public:
     static constexpr unsigned BASE_SHIFT = 12;
 
+    /// Start of the linear mapping of physical memory, PML4 entry 256
+    static constexpr uintptr_t PHYSMAP_BASE = 0xffff800000000000;
+    /// Size of a page mapped by a page directory entry
+    static constexpr uintptr_t LARGE_PAGE_SIZE = 0x200000;
+    /// Size of a page mapped by a page directory pointer entry
+    static constexpr uintptr_t HUGE_PAGE_SIZE = 0x40000000;
+    /// End of the lower half of the address space, used by processes
+    static constexpr uintptr_t USER_SPACE_END = 0x0000800000000000;
+    /** Number of pages populated around a deferred fault
+     *
+     * The window is aligned on its size, so it never crosses a page table.
+     */
+    static constexpr std::size_t FAULT_AROUND_PAGES = 16;
+    /// Above this number of pages, unmapRange() flushes the whole TLB
+    static constexpr std::size_t INVALIDATE_PAGE_THRESHOLD = 32;
+
     static constexpr unsigned ATTR_RW     = 0x1;
     static constexpr unsigned ATTR_PUBLIC = 0x2;
     static constexpr unsigned ATTR_NOEXEC = 0x4;
     static constexpr unsigned ATTR_DEFER  = 0x8;
+    /// Only for mapPage, the page is taken from the zeroed page pool
+    static constexpr unsigned ATTR_ZERO   = 0x10;
 
     struct PageTableEntry
     {
       static constexpr uint8_t ADD_BITS = 9;
       static constexpr uint8_t BASE_SHIFT = ::PageDirectory::BASE_SHIFT;
 
+      /// avl bit of a page which is writable but shared read-only until written
+      static constexpr uint8_t AVL_COW = 0x1;
+
       unsigned long long p    : 1; ///< Present
       unsigned long long rw   : 1; ///< Read/Write
       unsigned long long us   : 1; ///< User/Supervisor
@@ -38,7 +59,8 @@ class PageDirectory
       uint8_t getAttributes() const
       {
         uint8_t attr = 0;
-        if (rw)
+        // a copy-on-write page is writable for its owner
+        if (rw || isCopyOnWrite())
           attr |= ATTR_RW;
         if (us)
           attr |= ATTR_PUBLIC;
@@ -53,6 +75,22 @@ class PageDirectory
       {
         return p || base == INVALID_PAGE;
       }
+
+      bool isCopyOnWrite() const
+      {
+        return avl & AVL_COW;
+      }
+
+      /// In directory entries, bit 7 is PS and the entry maps a large page
+      bool isLargePage() const
+      {
+        return p && pat;
+      }
+      /// Large page which will be allocated on first access
+      bool isDeferredLargePage() const
+      {
+        return !p && pat && base == INVALID_PAGE;
+      }
     };
 
     static_assert(sizeof(PageTableEntry) == 8, "sizeof(PageTableEntry) != 8");
@@ -76,8 +114,24 @@ class PageDirectory
     PageDirectory& operator=(const PageDirectory& pd) = delete;
     PageDirectory& operator=(PageDirectory&& pd) noexcept;
 
+    ~PageDirectory();
+
     static PageDirectory* initKernelDirectory();
     static PageDirectory* getKernelDirectory();
+    /** Map all usable RAM at PHYSMAP_BASE in the kernel directory
+     *
+     * Must be called once paging is up, before any process is created.
+     */
+    static void initPhysmap();
+
+    /// Get the address of physical address \p paddr in the physical memory map
+    static void* physToVirt(physaddr_t paddr);
+    /** Get the physical address of \p vaddr
+     *
+     * This is a subtraction for addresses of the physical memory map, other
+     * addresses are resolved in the current directory.
+     */
+    static physaddr_t virtToPhys(const void* vaddr);
 
     static PageDirectory* getCurrent();
 
@@ -95,31 +149,89 @@ class PageDirectory
     void mapPageTo(void* vaddr, physaddr_t paddr, uint8_t attributes);
     /** Map a virtual address \p vaddr to any free page
      *
-     * Return physical address in \p paddr.
+     * Return physical address in \p paddr. With ATTR_ZERO, the page is filled
+     * with zeros.
      */
     void mapPage(void* vaddr, uint8_t attributes, physaddr_t* paddr = nullptr);
 
-    /// Map a from \p vastart to \p vaend with \p attributes
+    /** Map pages from \p vastart to \p vaend to any free pages
+     *
+     * Page tables are walked once per table instead of once per page.
+     */
     void mapRange(void* vastart, void* vaend, uint8_t attributes);
+    /** Map from \p vastart to \p vaend with \p attributes.
+     *
+     * This will allocate contiguous pages from \p pastart. Parts of the range
+     * which are aligned both in virtual and physical memory are mapped with
+     * large pages, unless a page table already covers them.
+     *
+     * This function does not assert that paging is ready, the kernel is mapped
+     * with it during initialization.
+     */
+    void mapRangeTo(void* vastart, void* vaend, physaddr_t pastart,
+        uint8_t attributes);
+    /** Reserve a LARGE_PAGE_SIZE page at \p vaddr, allocated on first access
+     *
+     * If no physically contiguous memory is available at that time, the page
+     * falls back to deferred 4KB pages.
+     */
+    void mapDeferredLargePage(void* vaddr, uint8_t attributes);
+    /// Allocate the deferred pages from \p vastart to \p vaend now
+    void populateRange(void* vastart, void* vaend);
 
     /// Unmap a page and return the physical address it pointed to
     physaddr_t unmapPage(void* vaddr);
+    /** Unmap pages from \p vastart to \p vaend
+     *
+     * \p f is called with the physical address of each page. The TLB is
+     * invalidated once at the end, with a full flush for large ranges.
+     */
+    void unmapRange(void* vastart, void* vaend,
+        const std::function<void(physaddr_t)>& f = {});
 
     void unmapUserSpace();
+    /** Unmap the user pages from \p vastart to \p vaend
+     *
+     * Their frames are released, deferred pages are dropped and page tables
+     * left empty are freed.
+     */
+    void unmapUserRange(void* vastart, void* vaend);
+    /** Map the user pages of this directory in \p target, copy-on-write
+     *
+     * Frames are shared and their reference count incremented. Writable pages
+     * become read-only in both directories until one of them writes to it.
+     */
+    void shareUserSpace(PageDirectory& target);
 
     physaddr_t resolve(void* vaddr);
 
     /** Handles fault due to a deferred allocation
+     *
+     * The deferred pages of the FAULT_AROUND_PAGES window around \p vaddr are
+     * allocated too, as long as there is free memory.
      *
      * \return true if the fault was handled, false otherwise
      */
     bool handleFault(void* vaddr);
+    /// Number of deferred allocation faults handled since boot
+    static uint64_t getDeferredFaultCount();
+    /** Handles write fault on a present page, due to copy-on-write
+     *
+     * \return true if the fault was handled, false otherwise
+     */
+    bool handleWriteFault(void* vaddr);
 
     bool isPageMapped(void* vaddr);
     std::optional<physaddr_t> getPhysicalAddress(void* vaddr);
 
-    void forEachUserPage(
-        const std::function<void(PageTableEntry&, void*, physaddr_t)>& f);
+    /** Call \p f on each user page
+     *
+     * \p f is called with the entry, its address and its physical address.
+     * Large pages, and deferred ones, are given once with their directory
+     * entry. Only present page tables are walked.
+     */
+    template <typename F>
+    void forEachUserPage(const F& f);
 
     void use();
 
@@ -157,21 +269,41 @@ class PageDirectory
     CR3 m_directory;
     std::unique_ptr<X86_64PageManager, X86_64PageManager::Deleter> m_manager;
 
+    /** Process-context identifier, 0 when none is allocated
+     *
+     * It is allocated on the first use(), so that switching back to this
+     * directory keeps its TLB entries.
+     */
+    uint16_t m_pcid = 0;
+    /// The PCID was used before, its TLB entries must be flushed on next use
+    bool m_pcidStale = false;
+
+    /// Give back the PCID, if any
+    void releasePcid();
+
     void createPm();
     void initWithDefaultPaging();
 
     /// Map \p vaddr to \p paddr with \p attributes
     void _mapPageTo(void* vaddr, physaddr_t paddr, uint8_t attributes);
 
-    /** Map from \p vastart to \p vaend with \p attributes.
+    /** Map 4KB pages from \p vastart to \p vaend, filling each entry with \p f
      *
-     * This will allocate contiguous pages from \p pastart.
+     * \p f is called with the entry and its virtual address. The range is
+     * walked once per page table and the page pool is refilled after each
+     * table, once paging is ready.
+     */
+    template <typename F>
+    void mapPagesF(char* vastart, char* vaend, const F& f);
+
+    /** Invalidate pages from \p vastart to \p vaend in the TLB
      *
-     * This function does not assert that paging is ready and does not refill
-     * the page pool.
+     * Above INVALIDATE_PAGE_THRESHOLD pages, the whole TLB is flushed instead.
+     * If this directory is not loaded and the pages are not global, its PCID
+     * is flushed on next use.
      */
-    void mapRangeTo(void* vastart, void* vaend, physaddr_t pastart,
-        uint8_t attributes);
+    void invalidateRange(void* vastart, void* vaend);
+    void invalidatePage(void* vaddr);
 
     /** Do the real mapping and nothing else
      *
@@ -182,6 +314,29 @@ class PageDirectory
      */
     template <typename F>
     void mapPageToF(void* vaddr, physaddr_t paddr, const F& f);
+
+    /** Map a large page at \p Level
+     *
+     * Level 1 maps a LARGE_PAGE_SIZE page, level 2 a HUGE_PAGE_SIZE one.
+     * Both addresses must be aligned on that size.
+     */
+    template <unsigned Level>
+    void mapLargePageTo(void* vaddr, physaddr_t paddr, uint8_t attributes);
+
+    /** Resolve \p vaddr if it is in a large page
+     *
+     * \return the physical address of the 4KB page containing \p vaddr, or
+     * INVALID_PHYS
+     */
+    physaddr_t resolveLarge(void* vaddr);
+
+    /// Release the frames of user entry \p e, which maps \p phys
+    static void releaseUserFrames(PageTableEntry& e, physaddr_t phys);
+
+    /// Allocate a deferred large page, or fall back to 4KB pages
+    bool handleLargeFault(void* vaddr);
+    /// Remap the large page at \p vaddr with 4KB pages
+    void splitLargePage(void* vaddr);
 };
 
 inline PageDirectory::PageDirectory() :
@@ -192,23 +347,46 @@ inline PageDirectory::PageDirectory() :
 
 inline PageDirectory::PageDirectory(PageDirectory&& pd) :
   m_directory(pd.m_directory),
-  m_manager(std::move(pd.m_manager))
+  m_manager(std::move(pd.m_manager)),
+  m_pcid(pd.m_pcid),
+  m_pcidStale(pd.m_pcidStale)
 {
   pd.m_directory.value = 0;
   pd.m_manager = nullptr;
+  pd.m_pcid = 0;
 }
 
 inline PageDirectory& PageDirectory::operator=(PageDirectory&& pd)
 {
+  releasePcid();
+
   m_directory = pd.m_directory;
   m_manager = std::move(pd.m_manager);
+  m_pcid = pd.m_pcid;
+  m_pcidStale = pd.m_pcidStale;
 
   pd.m_directory.value = 0;
   pd.m_manager = nullptr;
+  pd.m_pcid = 0;
 
   return *this;
 }
 
+inline PageDirectory::~PageDirectory()
+{
+  releasePcid();
+}
+
+template <typename F>
+void PageDirectory::forEachUserPage(const F& f)
+{
+  m_manager->forEachEntry(0, USER_SPACE_END,
+      [&](PageTableEntry& entry, uintptr_t address) {
+        f(entry, reinterpret_cast<void*>(address),
+            static_cast<physaddr_t>(entry.base << BASE_SHIFT));
+      });
+}
+
 inline PageDirectory* PageDirectory::getKernelDirectory()
 {
   return g_kernelDirectory;
@@ -9,20 +9,30 @@ XLL_LOG_CATEGORY("core/memory/pageheap");
 
 PdPageHeap& getPdPageHeap()
 {
-  static PdPageHeap pageHeap(Symbols::getPageHeapBase());
+  static PdPageHeap pageHeap(Symbols::getPageHeapBase(),
+      Symbols::getStackPageHeapBase());
   return pageHeap;
 }
 
 StackPageHeap& getStackPageHeap()
 {
-  static StackPageHeap pageHeap(Symbols::getStackPageHeapBase());
+  static StackPageHeap pageHeap(Symbols::getStackPageHeapBase(),
+      Symbols::getSlabHeapBase());
   return pageHeap;
 }
 
 template <unsigned BSize, unsigned PSize, unsigned SSize>
-PageHeap<BSize, PSize, SSize>::PageHeap(char* heapStart)
+PageHeap<BSize, PSize, SSize>::PageHeap(char* heapStart, char* heapEnd)
   : m_heapStart(heapStart)
 {
+  const std::size_t blockCount = (heapEnd - heapStart) / PAGE_SIZE / BlockSize;
+
+  m_freeBlocks.init(blockCount);
+  m_freeBlocks.assignRange(0, blockCount, true);
+  m_freeSplitPages.init(blockCount * BlockSize);
+  m_pool.reserve(PoolSize);
+
+  Memory::get().addReclaimHandler(&reclaimHandler, this);
 }
 
 template <unsigned BSize, unsigned PSize, unsigned SSize>
@@ -32,6 +42,68 @@ std::pair<void*, physaddr_t> PageHeap<BSize, PSize, SSize>::kmalloc()
   return {pageToPtr(item.first), item.second};
 }
 
+template <unsigned BSize, unsigned PSize, unsigned SSize>
+std::pair<void*, physaddr_t> PageHeap<BSize, PSize, SSize>::kmallocPage()
+{
+  const std::size_t page = m_freeSplitPages.findFirstSet();
+  if (page != HierarchicalBitmap::npos)
+  {
+    m_freeSplitPages.clear(page);
+    --m_freeSplitPageCount;
+
+    char* const ptr = m_heapStart + page * PAGE_SIZE;
+    return {ptr, *reinterpret_cast<physaddr_t*>(ptr)};
+  }
+
+  // allocating may reenter, the bitmap must only be touched once it's done
+  std::pair<page_index_t, physaddr_t> item = allocBlock();
+  char* const ptr = static_cast<char*>(pageToPtr(item.first));
+
+  // keep the first page and make the others available, only static blocks
+  // are known to be contiguous
+  const bool isStatic = item.first * BlockSize < StaticSize;
+  for (unsigned n = 1; n < BlockSize; ++n)
+    *reinterpret_cast<physaddr_t*>(ptr + n * PAGE_SIZE) = isStatic ?
+      item.second + n * PAGE_SIZE :
+      PageDirectory::getKernelDirectory()->resolve(ptr + n * PAGE_SIZE);
+  m_freeSplitPages.assignRange(item.first * BlockSize + 1,
+      (item.first + 1) * BlockSize, true);
+  m_freeSplitPageCount += BlockSize - 1;
+
+  return {ptr, item.second};
+}
+
+template <unsigned BSize, unsigned PSize, unsigned SSize>
+void PageHeap<BSize, PSize, SSize>::kfreePage(void* ptr)
+{
+  if (!ptr)
+    return;
+
+  const std::size_t page = (static_cast<char*>(ptr) - m_heapStart) / PAGE_SIZE;
+  const page_index_t index = page / BlockSize;
+
+  assert(!m_freeBlocks.test(index));
+  assert(!m_freeSplitPages.test(page) && "Page freed twice");
+
+  const std::size_t first = index * BlockSize;
+  const std::size_t last = first + BlockSize;
+
+  // give back the whole block if all the other pages are free
+  m_freeSplitPages.set(page);
+  if (m_freeSplitPages.findNextClear(first, last) == last)
+  {
+    m_freeSplitPages.assignRange(first, last, false);
+    m_freeSplitPageCount -= BlockSize - 1;
+    kfree(pageToPtr(index));
+    return;
+  }
+
+  const physaddr_t phys =
+    PageDirectory::getKernelDirectory()->resolve(ptr);
+  *static_cast<physaddr_t*>(ptr) = phys;
+  ++m_freeSplitPageCount;
+}
+
 template <unsigned BSize, unsigned PSize, unsigned SSize>
 auto PageHeap<BSize, PSize, SSize>::allocBlock()
     -> std::pair<page_index_t, physaddr_t>
@@ -49,12 +121,18 @@ auto PageHeap<BSize, PSize, SSize>::allocBlock()
     return ret;
   }
 
-  for (unsigned int i = 0; i < m_map.size(); ++i)
-    if (!m_map[i])
-      return allocPage(i);
+  // a cached block needs no mapping at all
+  if (m_cacheCount)
+  {
+    ++m_usedBlockCount;
+    return m_cache[--m_cacheCount];
+  }
+
+  // lowest free block first, to keep the heap compact
+  const std::size_t index = m_freeBlocks.findFirstSet();
+  if (index == HierarchicalBitmap::npos)
+    PANIC("Page heap is full");
 
-  page_index_t index = m_map.size();
-  m_map.resize(index + 1);
   return allocPage(index);
 }
 
@@ -65,29 +143,37 @@ auto PageHeap<BSize, PSize, SSize>::allocPage(page_index_t index)
   m_allocating = true;
 
   // assert page is not used yet
-  assert(index >= m_map.size() || !m_map[index]);
-
-  // resize vector if page is too far
-  if (index >= m_map.size())
-  {
-    // for now, there should be no reason we ask a page too far appart
-    assert(index == m_map.size());
-    m_map.resize(index + 1, false);
-  }
+  assert(m_freeBlocks.test(index));
 
-  m_map[index] = true;
+  m_freeBlocks.clear(index);
 
   physaddr_t phys;
   // first StaticSize pages are always mapped
   if (index * BlockSize >= StaticSize)
   {
-    PageDirectory::getKernelDirectory()->mapPage(pageToPtr(index),
-        PageDirectory::ATTR_RW | PageDirectory::ATTR_NOEXEC,
-        &phys);
-    for (unsigned n = 1; n < BlockSize; ++n)
-      PageDirectory::getKernelDirectory()->mapPage(
-          static_cast<char*>(pageToPtr(index)) + n * PAGE_SIZE,
-          PageDirectory::ATTR_RW | PageDirectory::ATTR_NOEXEC);
+    auto& memory = Memory::get();
+    auto* const pd = PageDirectory::getKernelDirectory();
+    char* const ptr = static_cast<char*>(pageToPtr(index));
+    const uint8_t attributes =
+      PageDirectory::ATTR_RW | PageDirectory::ATTR_NOEXEC;
+
+    // contiguous frames are mapped in one go, when memory is too fragmented
+    // for that the block is made of separate frames
+    const page_t first = memory.getFreePages(BlockSize);
+    if (first != INVALID_PAGE)
+    {
+      phys = first * PAGE_SIZE;
+      pd->mapRangeTo(ptr, ptr + BlockSize * PAGE_SIZE, phys, attributes);
+    }
+    else
+    {
+      xDeb("No contiguous physical memory for block %d", index);
+      phys = memory.getFreePage() * PAGE_SIZE;
+      pd->mapPageTo(ptr, phys, attributes);
+      for (unsigned n = 1; n < BlockSize; ++n)
+        pd->mapPageTo(ptr + n * PAGE_SIZE, memory.getFreePage() * PAGE_SIZE,
+            attributes);
+    }
   }
   else
     phys = Symbols::getKernelPageHeapStart() + index * PAGE_SIZE * BlockSize;
@@ -107,21 +193,78 @@ void PageHeap<BSize, PSize, SSize>::kfree(void* ptr)
 
   page_index_t index = ptrToPage(ptr);
 
-  assert(index < m_map.size());
-  assert(m_map[index]);
+  assert(index < m_freeBlocks.size());
+  assert(!m_freeBlocks.test(index));
+
+  --m_usedBlockCount;
 
   // first StaticSize pages are always mapped
-  if (index * BlockSize >= StaticSize)
-    for (unsigned n = 0; n < BlockSize; ++n)
-    {
-      physaddr_t phys = PageDirectory::getKernelDirectory()->unmapPage(
-          static_cast<char*>(ptr) + n * PAGE_SIZE);
-      Memory::get().setPageFree(phys / PAGE_SIZE);
-    }
+  if (index * BlockSize < StaticSize)
+  {
+    m_freeBlocks.set(index);
+    return;
+  }
 
-  --m_usedBlockCount;
+  // keep the block mapped, the next allocation will skip mapping it again
+  if (m_cacheCount < CacheSize)
+  {
+    m_cache[m_cacheCount++] = {index,
+      PageDirectory::getKernelDirectory()->resolve(ptr)};
+    return;
+  }
+
+  unmapBlock(index);
+}
 
-  m_map[index] = false;
+template <unsigned BSize, unsigned PSize, unsigned SSize>
+void PageHeap<BSize, PSize, SSize>::unmapBlock(page_index_t index)
+{
+  char* const ptr = static_cast<char*>(pageToPtr(index));
+
+  physaddr_t frames[BlockSize];
+  unsigned n = 0;
+  bool contiguous = true;
+  PageDirectory::getKernelDirectory()->unmapRange(ptr,
+      ptr + BlockSize * PAGE_SIZE, [&](physaddr_t phys) {
+        contiguous = contiguous && (!n || phys == frames[0] + n * PAGE_SIZE);
+        frames[n++] = phys;
+      });
+  assert(n == BlockSize);
+
+  // a contiguous range goes back to the frame map as a whole so that a
+  // block can be made from it again, other frames are given back one by one
+  auto& memory = Memory::get();
+  if (contiguous)
+    memory.setPagesFree(frames[0] / PAGE_SIZE, BlockSize);
+  else
+    for (unsigned i = 0; i < n; ++i)
+      memory.setPageFree(frames[i] / PAGE_SIZE);
+
+  m_freeBlocks.set(index);
+}
+
+template <unsigned BSize, unsigned PSize, unsigned SSize>
+std::size_t PageHeap<BSize, PSize, SSize>::reclaim()
+{
+  // allocPage() gets frames from Memory, which may call us back while the
+  // cache and the block map are being modified
+  if (m_allocating)
+    return 0;
+
+  const std::size_t pageCount = m_cacheCount * BlockSize;
+  if (pageCount)
+    xDeb("Reclaiming %d cached blocks", m_cacheCount);
+
+  while (m_cacheCount)
+    unmapBlock(m_cache[--m_cacheCount].first);
+
+  return pageCount;
+}
+
+template <unsigned BSize, unsigned PSize, unsigned SSize>
+std::size_t PageHeap<BSize, PSize, SSize>::reclaimHandler(void* pageHeap)
+{
+  return static_cast<PageHeap*>(pageHeap)->reclaim();
 }
 
 template <unsigned BSize, unsigned PSize, unsigned SSize>
@@ -5,6 +5,7 @@
 #include <vector>
 #include <utility>
 
+#include "HierarchicalBitmap.hpp"
 #include "Types.hpp"
 
 template <unsigned BSize, unsigned PSize, unsigned SSize>
@@ -16,22 +17,52 @@ public:
   static constexpr unsigned BlockSize = BSize;  // in pages
   static constexpr unsigned PoolSize = PSize;   // in blocks
   static constexpr unsigned StaticSize = SSize; // in pages
+  /// Number of freed blocks kept mapped for reuse
+  static constexpr unsigned CacheSize = 16;       // in blocks
 
-  explicit PageHeap(char* heapStart);
+  /** Create a heap spanning from \p heapStart to \p heapEnd
+   *
+   * The block map is allocated here for the whole region, so that it never
+   * needs to allocate again while page tables are being built.
+   */
+  PageHeap(char* heapStart, char* heapEnd);
 
   /**
    * Allocate BSize pages of memory on the page heap
    *
    * \return the virtual address of the allocation and the physical address
-   * of the first page.
+   * of the first page, the pages are not always physically contiguous.
    */
   std::pair<void*, physaddr_t> kmalloc();
   void kfree(void* ptr);
+  /** Allocate a single page
+   *
+   * Blocks are split so that their pages can be handed out one by one, a
+   * block is freed when all its pages are.
+   */
+  std::pair<void*, physaddr_t> kmallocPage();
+  void kfreePage(void* ptr);
   void refillPool();
+  /** Unmap the cached blocks and give their pages back
+   *
+   * Does nothing while the heap is allocating a block.
+   *
+   * \return the number of pages freed
+   */
+  std::size_t reclaim();
   uint64_t getUsedBlockCount() const
   {
     return m_usedBlockCount;
   }
+  /// Number of pages in use, free pages of split blocks are not counted
+  uint64_t getUsedPageCount() const
+  {
+    return m_usedBlockCount * BlockSize - m_freeSplitPageCount;
+  }
+  unsigned getCachedBlockCount() const
+  {
+    return m_cacheCount;
+  }
 
 private:
   uint64_t m_usedBlockCount = 0;
@@ -39,12 +70,29 @@ private:
   bool m_allocating = false;
   char* m_heapStart;
 
-  std::vector<bool> m_map;
+  /// Bit set means the block is free
+  HierarchicalBitmap m_freeBlocks;
+  /** Bit set means the page is free in a block allocated by kmallocPage()
+   *
+   * A free page holds its own physical address.
+   */
+  HierarchicalBitmap m_freeSplitPages;
+  uint64_t m_freeSplitPageCount = 0;
   std::vector<std::pair<page_index_t, physaddr_t>> m_pool;
+  /** Free blocks which are still mapped, used first by allocBlock()
+   *
+   * They stay cleared in m_freeBlocks.
+   */
+  std::pair<page_index_t, physaddr_t> m_cache[CacheSize];
+  unsigned m_cacheCount = 0;
 
   std::pair<page_index_t, physaddr_t> allocBlock();
   std::pair<page_index_t, physaddr_t> allocPage(page_index_t index);
 
+  void unmapBlock(page_index_t index);
+
+  static std::size_t reclaimHandler(void* pageHeap);
+
   void* pageToPtr(page_index_t index);
   page_index_t ptrToPage(void* ptr);
 };
@@ -4,6 +4,8 @@
 #include <cstdint>
 #include <cstring>
 #include <new>
+#include <algorithm>
+#include "Types.hpp"
 #include "Debug.hpp"
 
 template <typename T>
@@ -78,84 +80,58 @@ class PageManager
       *thisPair.second = *otherPair.second;
     }
 
-    class Iterator
+    /** Call \p f on each leaf entry overlapping [\p start, \p end)
+     *
+     * \p f is called with the entry and its canonical address. Leaves are
+     * the valid entries of the last level, and the valid entries of upper
+     * levels which have no next level (large pages). Subtrees which are not
+     * present are skipped without looking at their entries.
+     *
+     * \p f may add a next level to the entry it is given, it won't be
+     * visited.
+     */
+    template <typename F>
+    void forEachEntry(uintptr_t start, uintptr_t end, const F& f)
     {
-    public:
-      const std::tuple<Entry*, NextLayout**>& operator*() const
-      {
-        return m_ptr;
-      }
-      const std::tuple<Entry*, NextLayout**>* operator->() const
-      {
-        return &m_ptr;
-      }
-
-      Iterator& operator++()
-      {
-        assert(*this);
-        ++std::get<0>(m_ptr);
-        ++std::get<1>(m_ptr);
-        return *this;
-      }
-      Iterator operator+(int skip) const
-      {
-        assert(*this);
-        Iterator out = *this;
-        std::get<0>(out->m_ptr) += skip;
-        std::get<1>(out->m_ptr) += skip;
-        return out;
-      }
-
-      bool operator==(const Iterator& other) const
-      {
-        // if one pointer is equal, both should be
-        assert((std::get<0>(m_ptr) == std::get<0>(other.m_ptr)) ==
-               (std::get<1>(m_ptr) == std::get<1>(other.m_ptr)));
-        return std::get<0>(m_ptr) == std::get<0>(other.m_ptr);
-      }
-      bool operator!=(const Iterator& other) const
-      {
-        return !(*this == other);
-      }
-
-      explicit operator bool() const
-      {
-        assert(!!std::get<0>(m_ptr) == !!std::get<1>(m_ptr));
-        return std::get<0>(m_ptr);
-      }
-
-    private:
-      std::tuple<Entry*, NextLayout**> m_ptr = {nullptr, nullptr};
-
-      Iterator(Entry* entry, NextLayout** layout)
-        : m_ptr{entry, layout}
-      {
-        assert(!!std::get<0>(m_ptr) == !!std::get<1>(m_ptr));
-      }
+      static constexpr unsigned SHIFT = 64 - TOTAL_BITS;
+      static constexpr uintptr_t MASK = (uintptr_t(1) << TOTAL_BITS) - 1;
 
-      friend ThisLayout;
-    };
+      assert(start < end);
 
-    Iterator begin()
-    {
-      return Iterator(&m_entries[0], &m_nextLayouts[0]);
+      // work on linear addresses and give canonical ones to f
+      const auto canonicalF = [&](auto& entry, uintptr_t address) {
+        f(entry, static_cast<uintptr_t>(
+              static_cast<intptr_t>(address << SHIFT) >> SHIFT));
+      };
+      forEachEntryImpl(0, start & MASK, ((end - 1) & MASK) + 1, canonicalF);
     }
 
-    Iterator end()
+    /** Free the layouts overlapping [\p start, \p end) which are left empty
+     *
+     * This layout itself is never freed.
+     */
+    void releaseEmpty(uintptr_t start, uintptr_t end)
     {
-      return Iterator(
-          &m_entries[1 << ADD_BITS], &m_nextLayouts[1 << ADD_BITS]);
-    }
+      static constexpr uintptr_t MASK = (uintptr_t(1) << TOTAL_BITS) - 1;
 
-    uintptr_t getAddress(const Entry& entry) const
-    {
-      return addressFromIndex(&entry - m_entries);
+      assert(start < end);
+
+      releaseEmptyImpl(0, start & MASK, ((end - 1) & MASK) + 1);
     }
 
   private:
     Entry m_entries[1 << ADD_BITS];
     NextLayout* m_nextLayouts[1 << ADD_BITS];
 
+    static auto allocateLayout()
+    {
+      return Allocator::get().kmalloc();
+    }
+    static void freeLayout(ThisLayout* ptr)
+    {
+      Allocator::get().kfree(ptr);
+    }
+
     template <unsigned RevLevel>
     auto getEntryImpl(uintptr_t address) ->
       typename std::enable_if<RevLevel != 0,
@@ -183,9 +159,54 @@ class PageManager
     {
       return (address >> (TOTAL_BITS - ADD_BITS)) & ((1 << ADD_BITS) - 1);
     }
-    static uintptr_t addressFromIndex(uintptr_t index)
+
+    /// \p base is the address of the first entry of this layout
+    template <typename F>
+    void forEachEntryImpl(uintptr_t base, uintptr_t start, uintptr_t end,
+        const F& f)
+    {
+      static constexpr unsigned SHIFT = TOTAL_BITS - ADD_BITS;
+
+      const uintptr_t first = start > base ? (start - base) >> SHIFT : 0;
+      const uintptr_t last = std::min<uintptr_t>((end - 1 - base) >> SHIFT,
+          (1 << ADD_BITS) - 1);
+
+      for (uintptr_t index = first; index <= last; ++index)
+      {
+        const uintptr_t address = base + (index << SHIFT);
+        if (NextLayout* next = m_nextLayouts[index])
+          next->forEachEntryImpl(address, start, end, f);
+        else if (m_entries[index].isValid())
+          f(m_entries[index], address);
+      }
+    }
+
+    /// \return true if the layout has no entry left
+    bool releaseEmptyImpl(uintptr_t base, uintptr_t start, uintptr_t end)
     {
-      return (index << (TOTAL_BITS - ADD_BITS));
+      static constexpr unsigned SHIFT = TOTAL_BITS - ADD_BITS;
+
+      const uintptr_t first = start > base ? (start - base) >> SHIFT : 0;
+      const uintptr_t last = std::min<uintptr_t>((end - 1 - base) >> SHIFT,
+          (1 << ADD_BITS) - 1);
+
+      for (uintptr_t index = first; index <= last; ++index)
+      {
+        NextLayout*& next = m_nextLayouts[index];
+        if (next &&
+            next->releaseEmptyImpl(base + (index << SHIFT), start, end))
+        {
+          next->~NextLayout();
+          NextLayout::freeLayout(next);
+          next = nullptr;
+          m_entries[index] = Entry();
+        }
+      }
+
+      for (unsigned index = 0; index < (1 << ADD_BITS); ++index)
+        if (m_nextLayouts[index] || m_entries[index].isValid())
+          return false;
+      return true;
     }
 
     template <typename A, typename Clv, typename... Lv>
@@ -207,73 +228,21 @@ class PageManager<Allocator, CurLevel>
 
     PageManager();
 
-    class Iterator
-    {
-    public:
-      Iterator() = default;
-
-      Entry& operator*() const
-      {
-        return *m_ptr;
-      }
-      Entry* operator->() const
-      {
-        return m_ptr;
-      }
-
-      Iterator& operator++()
-      {
-        ++m_ptr;
-        return *this;
-      }
-      Iterator operator+(int skip) const
-      {
-        Iterator out = *this;
-        out->m_ptr += skip;
-        return out;
-      }
-
-      bool operator==(const Iterator& other) const
-      {
-        return m_ptr == other.m_ptr;
-      }
-      bool operator!=(const Iterator& other) const
-      {
-        return !(*this == other);
-      }
-
-      explicit operator bool() const
-      {
-        return m_ptr;
-      }
-
-    private:
-      Entry* m_ptr = nullptr;
-
-      explicit Iterator(Entry* entry)
-        : m_ptr(entry)
-      {}
-
-      friend ThisLayout;
-    };
-
-    Iterator begin()
-    {
-      return Iterator(&m_entries[0]);
-    }
+  private:
+    Entry m_entries[1 << ADD_BITS];
 
-    Iterator end()
+    // a page table only takes one page, two of them share a block
+    static_assert(sizeof(Entry) << ADD_BITS == PAGE_SIZE,
+        "Page table is not one page long");
+    static auto allocateLayout()
     {
-      return Iterator(&m_entries[1 << ADD_BITS]);
+      return Allocator::get().kmallocPage();
     }
-
-    uintptr_t getAddress(const Entry& entry) const
+    static void freeLayout(ThisLayout* ptr)
     {
-      return addressFromIndex(&entry - m_entries);
+      Allocator::get().kfreePage(ptr);
     }
 
-  private:
-    Entry m_entries[1 << ADD_BITS];
     template <unsigned RevLevel>
     typename std::enable_if<RevLevel == 0, std::pair<Entry*, void**>>::type
       getEntryImpl(uintptr_t address);
@@ -285,11 +254,29 @@ class PageManager<Allocator, CurLevel>
     {
       return (address >> (TOTAL_BITS - ADD_BITS)) & ((1 << ADD_BITS) - 1);
     }
-    static uintptr_t addressFromIndex(uintptr_t index)
+
+    template <typename F>
+    void forEachEntryImpl(uintptr_t base, uintptr_t start, uintptr_t end,
+        const F& f)
     {
-      return (index << (TOTAL_BITS - ADD_BITS));
+      static constexpr unsigned SHIFT = TOTAL_BITS - ADD_BITS;
+
+      const uintptr_t first = start > base ? (start - base) >> SHIFT : 0;
+      const uintptr_t last = std::min<uintptr_t>((end - 1 - base) >> SHIFT,
+          (1 << ADD_BITS) - 1);
+
+      for (uintptr_t index = first; index <= last; ++index)
+        if (m_entries[index].isValid())
+          f(m_entries[index], base + (index << SHIFT));
     }
 
+    bool releaseEmptyImpl(uintptr_t, uintptr_t, uintptr_t)
+    {
+      for (const auto& entry : m_entries)
+        if (entry.isValid())
+          return false;
+      return true;
+    }
 
     template <typename A, typename Clv, typename... Lv>
     friend class PageManager;
@@ -308,8 +295,9 @@ PageManager<Allocator, CurLevel, Levels...>::~PageManager()
   {
     // TODO remove this hack...
     // this hack is here to avoid freeing kernel pages which are shared between
-    // all processes
-    if (std::tuple_size<Levels>::value == 3 && i == ((1 << ADD_BITS) - 1))
+    // all processes, and the physical memory map (PML4 entry 256)
+    if (std::tuple_size<Levels>::value == 3 &&
+        (i == ((1 << ADD_BITS) - 1) || i == (1 << (ADD_BITS - 1))))
       continue;
 
     auto& next = m_nextLayouts[i];
@@ -317,7 +305,7 @@ PageManager<Allocator, CurLevel, Levels...>::~PageManager()
     if (next)
     {
       next->~NextLayout();
-      Allocator::get().kfree(next);
+      NextLayout::freeLayout(next);
     }
   }
 }
@@ -326,7 +314,7 @@ template <typename Allocator, typename CurLevel, typename... Levels>
 auto PageManager<Allocator, CurLevel, Levels...>::makeNew() ->
   PageManagerAlloc<ThisLayout>
 {
-  std::pair<void*, physaddr_t> memory = Allocator::get().kmalloc();
+  auto memory = allocateLayout();
   return {{new (memory.first) ThisLayout(), &ThisLayout::release},
     memory.second};
 }
@@ -337,7 +325,7 @@ void PageManager<Allocator, CurLevel, Levels...>::release(ThisLayout* ptr)
   if (ptr)
   {
     ptr->~PageManager();
-    Allocator::get().kfree(ptr);
+    freeLayout(ptr);
   }
 }
 
@@ -359,10 +347,10 @@ auto PageManager<Allocator, CurLevel, NextLevels...>::getEntryImpl(
   const uintptr_t index = indexFromAddress(address);
   NextLayout*& nextLayout = m_nextLayouts[index];
 
-  // if not present
+  // if not present, or mapped with a large page
   if (!nextLayout)
   {
-    assert(!m_entries[index].p
+    assert((!m_entries[index].p || m_entries[index].isLargePage())
         && "Incoherence between layouts and page directory");
     return {nullptr, nullptr};
   }
@@ -388,10 +376,10 @@ auto PageManager<Allocator, CurLevel, NextLevels...>::getEntryImpl(
     assert(!m_entries[index].p
         && "Incoherence between layouts and page directory");
     // create it
-    // TODO this allocates two pages, but on the last layer, PageManager only
-    // takes one, we should instantiate two of them to avoid wasting memory
-    std::pair<void*, physaddr_t> memory = Allocator::get().kmalloc();
+    auto memory = NextLayout::allocateLayout();
     nextLayout = new (memory.first) NextLayout();
+    // a deferred large page may have left bits here
+    m_entries[index] = Entry();
     m_entries[index].p = true;
     m_entries[index].base = memory.second >> CurLevel::BASE_SHIFT;
     init(m_entries[index]);
@@ -0,0 +1,135 @@
+#include "SlabHeap.hpp"
+#include "PageDirectory.hpp"
+#include "Util.hpp"
+#include "Debug.hpp"
+
+XLL_LOG_CATEGORY("core/memory/slabheap");
+
+void SlabHeap::init(char* heapStart)
+{
+  m_heapStart = heapStart;
+  m_heapEnd = heapStart;
+}
+
+unsigned SlabHeap::sizeToClass(std::size_t size)
+{
+  assert(size && size <= MaxSize);
+
+  if (size <= MinSize)
+    return 0;
+
+  // ceil(log2(size))
+  const unsigned shift = 64 - __builtin_clzll(size - 1);
+  return shift - MinSizeShift;
+}
+
+void* SlabHeap::kmalloc(std::size_t size)
+{
+  const unsigned sizeClass = sizeToClass(size);
+
+  char* page;
+  {
+    auto lock = m_lock.getScoped();
+
+    if (void* ptr = popObject(sizeClass))
+      return ptr;
+
+    if (m_heapEnd == m_heapStart + MaxPageCount * PAGE_SIZE)
+      PANIC("Slab heap is full");
+
+    // reserve the page now, we will map it once the lock is released
+    page = m_heapEnd;
+    m_heapEnd += PAGE_SIZE;
+  }
+
+  xDeb("No free object of size %d, mapping new slab at %p",
+      classToSize(sizeClass), page);
+
+  // mapping may allocate and reenter the heap, so it must be done unlocked
+  PageDirectory::getKernelDirectory()->mapPage(page,
+      PageDirectory::ATTR_RW | PageDirectory::ATTR_NOEXEC);
+
+  auto lock = m_lock.getScoped();
+
+  fillPage(page, sizeClass);
+
+  void* ptr = popObject(sizeClass);
+  assert(ptr);
+  return ptr;
+}
+
+void* SlabHeap::kmallocAtomic(std::size_t size)
+{
+  const unsigned sizeClass = sizeToClass(size);
+
+  auto lock = m_lock.getScoped();
+  return popObject(sizeClass);
+}
+
+void SlabHeap::kfree(void* ptr)
+{
+  assert(owns(ptr));
+
+  const std::size_t pageIndex =
+    (static_cast<char*>(ptr) - m_heapStart) / PAGE_SIZE;
+
+  auto lock = m_lock.getScoped();
+
+  assert(static_cast<char*>(ptr) < m_heapEnd);
+
+  pushObject(ptr, m_pageClasses[pageIndex]);
+}
+
+void SlabHeap::kfree(void* ptr, std::size_t size)
+{
+  assert(owns(ptr));
+
+  const unsigned sizeClass = sizeToClass(size);
+
+  assert(m_pageClasses[(static_cast<char*>(ptr) - m_heapStart) / PAGE_SIZE] ==
+      sizeClass && "Freeing with a size of another class");
+
+  auto lock = m_lock.getScoped();
+
+  pushObject(ptr, sizeClass);
+}
+
+void SlabHeap::pushObject(void* ptr, unsigned sizeClass)
+{
+  assert(reinterpret_cast<uintptr_t>(ptr) % classToSize(sizeClass) == 0 &&
+      "Freeing a pointer in the middle of a slab object");
+
+  FreeObject* object = static_cast<FreeObject*>(ptr);
+  object->next = m_freeLists[sizeClass];
+  m_freeLists[sizeClass] = object;
+
+  --m_usedObjectCount[sizeClass];
+}
+
+void* SlabHeap::popObject(unsigned sizeClass)
+{
+  FreeObject* object = m_freeLists[sizeClass];
+  if (!object)
+    return nullptr;
+
+  m_freeLists[sizeClass] = object->next;
+  ++m_usedObjectCount[sizeClass];
+  return object;
+}
+
+void SlabHeap::fillPage(char* page, unsigned sizeClass)
+{
+  m_pageClasses[(page - m_heapStart) / PAGE_SIZE] = sizeClass;
+
+  const std::size_t objectSize = classToSize(sizeClass);
+
+  // push objects from the end so that they are handed out in address order
+  for (char* ptr = page + PAGE_SIZE - objectSize;
+      ptr >= page;
+      ptr -= objectSize)
+  {
+    FreeObject* object = reinterpret_cast<FreeObject*>(ptr);
+    object->next = m_freeLists[sizeClass];
+    m_freeLists[sizeClass] = object;
+  }
+}
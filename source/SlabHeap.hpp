@@ -0,0 +1,104 @@
+#ifndef SLAB_HEAP_HPP
+#define SLAB_HEAP_HPP
+
+#include <cstdint>
+#include <cstddef>
+
+#include "SpinLock.hpp"
+#include "Types.hpp"
+
+/**
+ * Size-class allocator for small kernel objects
+ *
+ * Objects are grouped in size classes (powers of two from MinSize to MaxSize).
+ * Each class has its own free list threaded through the free objects, so
+ * allocating and freeing are O(1) in the common case. When a free list is
+ * empty, a new page is mapped in the slab region and cut into objects of that
+ * class.
+ *
+ * Objects have no header, the class of an object is found from the page it
+ * lies in.
+ */
+class SlabHeap
+{
+public:
+  static constexpr unsigned MinSizeShift = 4;
+  static constexpr unsigned MaxSizeShift = 11;
+  static constexpr std::size_t MinSize = 1 << MinSizeShift;
+  static constexpr std::size_t MaxSize = 1 << MaxSizeShift;
+  static constexpr unsigned ClassCount = MaxSizeShift - MinSizeShift + 1;
+
+  /// Size of the slab region in pages (64MB)
+  static constexpr std::size_t MaxPageCount = 0x4000;
+
+  SlabHeap() = default;
+  SlabHeap(const SlabHeap&) = delete;
+  SlabHeap& operator=(const SlabHeap&) = delete;
+
+  void init(char* heapStart);
+  bool isReady() const
+  {
+    return m_heapStart;
+  }
+
+  /// Allocate \p size bytes, \p size must be at most MaxSize
+  void* kmalloc(std::size_t size);
+  /** Allocate \p size bytes from the free lists only
+   *
+   * Never maps a page, so this is safe from interrupt handlers. Returns
+   * nullptr if the free list of the class is empty.
+   */
+  void* kmallocAtomic(std::size_t size);
+  void kfree(void* ptr);
+  /** Free \p ptr which was allocated with a size of \p size
+   *
+   * The class is computed from \p size, so the allocation must not have
+   * been aligned on more than its size.
+   */
+  void kfree(void* ptr, std::size_t size);
+
+  /// Tell if \p ptr was allocated by this heap
+  bool owns(const void* ptr) const
+  {
+    return m_heapStart && ptr >= m_heapStart &&
+      ptr < m_heapStart + MaxPageCount * PAGE_SIZE;
+  }
+
+  uint64_t getUsedObjectCount(unsigned sizeClass) const
+  {
+    return m_usedObjectCount[sizeClass];
+  }
+  uint64_t getPageCount() const
+  {
+    return (m_heapEnd - m_heapStart) / PAGE_SIZE;
+  }
+
+  static unsigned sizeToClass(std::size_t size);
+  static std::size_t classToSize(unsigned sizeClass)
+  {
+    return MinSize << sizeClass;
+  }
+
+private:
+  struct FreeObject
+  {
+    FreeObject* next;
+  };
+
+  SpinLock m_lock;
+
+  char* m_heapStart = nullptr;
+  char* m_heapEnd = nullptr;
+
+  FreeObject* m_freeLists[ClassCount] = {};
+  uint64_t m_usedObjectCount[ClassCount] = {};
+  /// Size class of each page of the region
+  uint8_t m_pageClasses[MaxPageCount];
+
+  void* popObject(unsigned sizeClass);
+  void pushObject(void* ptr, unsigned sizeClass);
+  /// Cut \p page in objects of \p sizeClass and put them in the free list
+  void fillPage(char* page, unsigned sizeClass);
+};
+
+#endif /* SLAB_HEAP_HPP */
@@ -38,4 +38,6 @@ DECLARE_VIRT_SYMBOL(kernelVVga, KernelVVga);
 DECLARE_VIRT_SYMBOL(stackBase, StackBase);
 DECLARE_VIRT_SYMBOL(pageHeapBase, PageHeapBase);
 DECLARE_VIRT_SYMBOL(stackPageHeapBase, StackPageHeapBase);
+DECLARE_VIRT_SYMBOL(slabHeapBase, SlabHeapBase);
 DECLARE_VIRT_SYMBOL(heapBase, HeapBase);
+DECLARE_VIRT_SYMBOL(largeHeapBase, LargeHeapBase);
@@ -28,7 +28,9 @@ public:
   static char* getStackBase();
   static char* getPageHeapBase();
   static char* getStackPageHeapBase();
+  static char* getSlabHeapBase();
   static char* getHeapBase();
+  static char* getLargeHeapBase();
 };
 
 #endif /* SYMBOLS_HPP */
@@ -7,6 +7,8 @@
 #include <array>
 #include <functional>
 #include <flix/stat.h>
+#include <flix/mman.h>
+#include <flix/errno.h>
 
 XLL_LOG_CATEGORY("core/syscall");
 
@@ -113,27 +115,113 @@ int arch_prctl(int code, unsigned long addr)
   return 0;
 }
 
-void* mmap(void*, size_t length)
+int munmap(void* addr, size_t length)
 {
-  xDeb("mmap: size %x", length);
+  xDeb("munmap(%p, %x)", addr, length);
 
-  if (length == 0)
-    return nullptr;
+  const uintptr_t start = reinterpret_cast<uintptr_t>(addr);
+  // areas only live below MMAP_END, this also keeps start + length from
+  // wrapping
+  if (start % PAGE_SIZE || length == 0 || length > VmaTree::MMAP_END ||
+      start > VmaTree::MMAP_END - length)
+    return -EINVAL;
+  const uintptr_t end = start + intAlignSup<uintptr_t>(length, PAGE_SIZE);
 
-  static uintptr_t curPtr = 0x00000000ff005000;
+  auto& task = TaskManager::get()->getActiveTask();
+  // only the parts which were mapped are unmapped
+  task.vmas.remove(start, end, [&](uintptr_t from, uintptr_t to) {
+        task.pageDirectory.unmapUserRange(reinterpret_cast<void*>(from),
+            reinterpret_cast<void*>(to));
+      });
+
+  return 0;
+}
+
+void* mmap(void* addr, size_t length, int prot, int flags)
+{
+  xDeb("mmap(%p, %x, %x, %x)", addr, length, prot, flags);
+
+  static constexpr int supportedProt = PROT_READ | PROT_WRITE | PROT_EXEC;
+  static constexpr int supportedFlags =
+    MAP_PRIVATE | MAP_FIXED | MAP_ANONYMOUS | MAP_POPULATE;
+  const auto fail = [](int error) { return reinterpret_cast<void*>(-error); };
+
+  // only private anonymous memory exists, file and shared mappings would
+  // silently lose their semantics
+  if (prot & ~supportedProt || flags & ~supportedFlags ||
+      !(flags & MAP_PRIVATE) || !(flags & MAP_ANONYMOUS))
+  {
+    xDeb("mmap: unsupported prot %x or flags %x", prot, flags);
+    return fail(EINVAL);
+  }
+
+  // bigger lengths would also wrap when aligned
+  if (length == 0 || length > VmaTree::MMAP_END - VmaTree::MMAP_BASE)
+    return fail(EINVAL);
+
+  const uintptr_t hint = reinterpret_cast<uintptr_t>(addr);
+  length = intAlignSup<uintptr_t>(length, PAGE_SIZE);
+
+  // large regions are backed by large pages, which must be aligned
+  const std::size_t alignment = length >= PageDirectory::LARGE_PAGE_SIZE ?
+    PageDirectory::LARGE_PAGE_SIZE : PAGE_SIZE;
+
+  auto& task = TaskManager::get()->getActiveTask();
+  auto& pd = task.pageDirectory;
+
+  uintptr_t curPtr;
+  if (flags & MAP_FIXED)
+  {
+    if (hint % PAGE_SIZE || hint < VmaTree::MMAP_BASE ||
+        hint > VmaTree::MMAP_END - length)
+      return fail(EINVAL);
+
+    // like POSIX, a fixed mapping replaces whatever was there
+    if (!task.vmas.isFree(hint, hint + length))
+    {
+      xDeb("mmap: MAP_FIXED replaces the mappings in [%p, %p)", addr,
+          hint + length);
+      munmap(addr, length);
+    }
+    curPtr = hint;
+  }
+  else
+    curPtr = task.vmas.findFree(hint, length, alignment);
+  if (!curPtr)
+    return fail(ENOMEM);
+
+  uint8_t attributes = PageDirectory::ATTR_PUBLIC;
+  if (prot & PROT_WRITE)
+    attributes |= PageDirectory::ATTR_RW;
+  if (!(prot & PROT_EXEC))
+    attributes |= PageDirectory::ATTR_NOEXEC;
 
   void* start = reinterpret_cast<void*>(curPtr);
+  const uintptr_t end = curPtr + length;
+  task.vmas.insert(curPtr, end, attributes);
 
-  size_t nbPages = (length + PAGE_SIZE - 1) / PAGE_SIZE;
-  auto& pd = TaskManager::get()->getActiveTask().pageDirectory;
-  while (nbPages--)
+  while (curPtr < end)
   {
-    pd.mapPage(reinterpret_cast<void*>(curPtr),
-        PageDirectory::ATTR_RW | PageDirectory::ATTR_PUBLIC |
-        PageDirectory::ATTR_DEFER | PageDirectory::ATTR_NOEXEC);
-    curPtr += PAGE_SIZE;
+    if (curPtr % PageDirectory::LARGE_PAGE_SIZE == 0 &&
+        end - curPtr >= PageDirectory::LARGE_PAGE_SIZE)
+    {
+      pd.mapDeferredLargePage(reinterpret_cast<void*>(curPtr), attributes);
+      curPtr += PageDirectory::LARGE_PAGE_SIZE;
+      continue;
+    }
+
+    // deferred 4KB pages up to the next large page boundary
+    const uintptr_t runEnd = std::min(end, intAlignSup<uintptr_t>(curPtr + 1,
+          PageDirectory::LARGE_PAGE_SIZE));
+    pd.mapRange(reinterpret_cast<void*>(curPtr),
+        reinterpret_cast<void*>(runEnd),
+        attributes | PageDirectory::ATTR_DEFER);
+    curPtr = runEnd;
   }
 
+  if (flags & MAP_POPULATE)
+    pd.populateRange(start, reinterpret_cast<void*>(end));
+
   xDeb("returning %p", start);
   return start;
 }
@@ -274,6 +362,7 @@ int execve(const char* filename, const char* argv[], const char* envp[])
   }
 
   PageDirectory::getCurrent()->unmapUserSpace();
+  TaskManager::get()->getActiveTask().vmas.clear();
 
   elf::exec(**exphandle, args);
 
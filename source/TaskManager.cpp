@@ -5,6 +5,7 @@
 #include "Symbols.hpp"
 #include "DescTables.hpp"
 #include "Util.hpp"
+#include "ZeroedPagePool.hpp"
 
 XLL_LOG_CATEGORY("core/taskmanager");
 
@@ -96,31 +97,11 @@ pid_t TaskManager::clone(const InterruptState& st)
   task.releaseFunction = [](auto& task){
     getStackPageHeap().kfree(task.kernelStack);
   };
-  auto& newPd = task.pageDirectory;
-
-  // TODO random address, use something less arbitrary
-  auto bufferPage = reinterpret_cast<char*>(0xffffffffaa000000);
 
   xDeb("Cloning memory");
-  auto& activeTask = getActiveTask();
-  auto& pd = activeTask.pageDirectory;
-  pd.forEachUserPage(
-      [&](const PageDirectory::PageTableEntry& entry, void* addr, physaddr_t)
-      {
-        xDeb("Cloning %p, %x", addr, entry.getAttributes());
-
-        physaddr_t physaddr;
-        newPd.mapPage(addr, entry.getAttributes(), &physaddr);
-
-        if (entry.getAttributes() & PageDirectory::ATTR_DEFER)
-          return;
-
-        pd.mapPageTo(bufferPage,
-            physaddr,
-            PageDirectory::ATTR_RW | PageDirectory::ATTR_NOEXEC);
-        memcpy(bufferPage, addr, PAGE_SIZE);
-        pd.unmapPage(bufferPage);
-      });
+  // pages are only copied when one of the processes writes to them
+  getActiveTask().pageDirectory.shareUserSpace(task.pageDirectory);
+  task.vmas = getActiveTask().vmas;
 
   task.sh.state = Task::State::Runnable;
   task.context = st.toTaskContext();
@@ -362,6 +343,11 @@ void TaskManager::enterSleep()
 
   setKernelStack();
 
+  // interrupts taken from here reuse this stack and never come back, so only
+  // let them in between two pages
+  while (ZeroedPagePool::get().refillOne())
+    asm volatile("sti\nnop\ncli":::"memory");
+
   enableInterrupts();
   asm volatile("hlt":::"memory");
 
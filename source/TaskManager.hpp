@@ -8,12 +8,15 @@
 #include "CondVar.hpp"
 #include "PageDirectory.hpp"
 #include "FileManager.hpp"
+#include "ObjectCache.hpp"
+#include "VmaTree.hpp"
 
 struct InterruptState;
 
 struct Task
 {
-  struct Context
+  /// Saved and restored on every switch, keep it on as few lines as possible
+  struct alignas(64) Context
   {
     // callee saved
     uint64_t r15, r14, r13, r12, rbx, rbp;
@@ -124,6 +127,8 @@ struct Task
 
   Context context;
   PageDirectory pageDirectory;
+  /// Areas mapped with mmap in pageDirectory
+  VmaTree vmas;
 
   char* stack;
   char* stackTop;
@@ -223,13 +228,14 @@ public:
   Task* getTask(pid_t tid);
 
 private:
-  using Tasks = std::set<Task, TaskComparator>;
+  // tasks are created and destroyed on each fork and exit, keep their nodes
+  using Tasks = std::set<Task, TaskComparator, CacheAllocator<Task>>;
 
   static TaskManager* instance;
 
   TaskStateSegment* _tss = nullptr;
 
-  std::set<Task, TaskComparator> _tasks;
+  Tasks _tasks;
   pid_t _activeTask = 0;
   pid_t _nextTid = 1;
 
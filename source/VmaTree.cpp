@@ -0,0 +1,67 @@
+#include "VmaTree.hpp"
+#include "Util.hpp"
+#include "Debug.hpp"
+
+XLL_LOG_CATEGORY("core/memory/vmatree");
+
+uintptr_t VmaTree::findFree(uintptr_t hint, std::size_t length,
+    std::size_t alignment) const
+{
+  assert(length && alignment);
+
+  // candidates stay below MMAP_END + alignment, so past this nothing wraps
+  if (length > MMAP_END - MMAP_BASE)
+    return 0;
+
+  if (hint && hint % alignment == 0 && hint >= MMAP_BASE &&
+      hint <= MMAP_END - length && isFree(hint, hint + length))
+    return hint;
+
+  // first fit, in address order
+  uintptr_t candidate = intAlignSup<uintptr_t>(MMAP_BASE, alignment);
+  for (const auto& vma : m_vmas)
+  {
+    if (vma.second.end <= candidate)
+      continue;
+    if (vma.second.start >= candidate + length)
+      break;
+    candidate = intAlignSup<uintptr_t>(vma.second.end, alignment);
+  }
+
+  if (candidate > MMAP_END - length)
+  {
+    xWar("No room for %x bytes in the address space", length);
+    return 0;
+  }
+
+  return candidate;
+}
+
+void VmaTree::insert(uintptr_t start, uintptr_t end, uint8_t attributes)
+{
+  assert(start < end);
+  assert(isFree(start, end) && "Inserting an overlapping area");
+
+  xDeb("New area %p-%p", start, end);
+
+  m_vmas.emplace(start, Vma{start, end, attributes});
+}
+
+const VmaTree::Vma* VmaTree::find(uintptr_t address) const
+{
+  auto iter = m_vmas.upper_bound(address);
+  if (iter == m_vmas.begin())
+    return nullptr;
+  --iter;
+  return address < iter->second.end ? &iter->second : nullptr;
+}
+
+bool VmaTree::isFree(uintptr_t start, uintptr_t end) const
+{
+  auto iter = m_vmas.lower_bound(start);
+  if (iter != m_vmas.end() && iter->second.start < end)
+    return false;
+  if (iter != m_vmas.begin() && std::prev(iter)->second.end > start)
+    return false;
+  return true;
+}
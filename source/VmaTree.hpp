@@ -0,0 +1,98 @@
+#ifndef VMA_TREE_HPP
+#define VMA_TREE_HPP
+
+#include <cstdint>
+#include <cstddef>
+#include <algorithm>
+#include <iterator>
+#include <map>
+
+#include "ObjectCache.hpp"
+
+/**
+ * Virtual memory areas of a process, the regions given by mmap
+ *
+ * Areas never overlap, so a tree sorted by start address is enough to find
+ * the area containing an address or a hole of a given size in O(log n).
+ */
+class VmaTree
+{
+public:
+  struct Vma
+  {
+    uintptr_t start;
+    uintptr_t end;
+    /// PageDirectory attributes of the pages of the area
+    uint8_t attributes;
+  };
+
+  /// Areas are placed from here when there is no hint
+  static constexpr uintptr_t MMAP_BASE = 0x00000000ff005000;
+  /// Areas stay below the user stack
+  static constexpr uintptr_t MMAP_END = 0x000000f000000000;
+
+  /** Find room for \p length bytes aligned on \p alignment
+   *
+   * \p hint is used if it is aligned and the range there is free.
+   *
+   * \return the start of the range, 0 if there is no room
+   */
+  uintptr_t findFree(uintptr_t hint, std::size_t length,
+      std::size_t alignment) const;
+
+  /// Add an area, it must not overlap existing ones
+  void insert(uintptr_t start, uintptr_t end, uint8_t attributes);
+
+  /** Remove [\p start, \p end) from the areas
+   *
+   * Areas which are partially covered are cut. \p f is called with each
+   * removed range, so that its pages can be unmapped.
+   */
+  template <typename F>
+  void remove(uintptr_t start, uintptr_t end, const F& f);
+
+  /// Get the area containing \p address, or nullptr
+  const Vma* find(uintptr_t address) const;
+
+  bool isFree(uintptr_t start, uintptr_t end) const;
+
+  std::size_t getCount() const
+  {
+    return m_vmas.size();
+  }
+  void clear()
+  {
+    m_vmas.clear();
+  }
+
+private:
+  using Vmas = std::map<uintptr_t, Vma, std::less<uintptr_t>,
+        CacheAllocator<std::pair<const uintptr_t, Vma>>>;
+
+  /// Areas by start address
+  Vmas m_vmas;
+};
+
+template <typename F>
+void VmaTree::remove(uintptr_t start, uintptr_t end, const F& f)
+{
+  auto iter = m_vmas.upper_bound(start);
+  if (iter != m_vmas.begin() && std::prev(iter)->second.end > start)
+    --iter;
+
+  while (iter != m_vmas.end() && iter->second.start < end)
+  {
+    const Vma vma = iter->second;
+    iter = m_vmas.erase(iter);
+
+    // keep the parts outside of the range
+    if (vma.start < start)
+      m_vmas.emplace(vma.start, Vma{vma.start, start, vma.attributes});
+    if (vma.end > end)
+      m_vmas.emplace(end, Vma{end, vma.end, vma.attributes});
+
+    f(std::max(vma.start, start), std::min(vma.end, end));
+  }
+}
+
+#endif /* VMA_TREE_HPP */
@@ -0,0 +1,126 @@
+#include "ZeroedPagePool.hpp"
+#include <algorithm>
+#include "PageDirectory.hpp"
+#include "Memory.hpp"
+#include "Debug.hpp"
+
+XLL_LOG_CATEGORY("core/memory/zeroedpagepool");
+
+ZeroedPagePool& ZeroedPagePool::get()
+{
+  static ZeroedPagePool pool;
+  return pool;
+}
+
+ZeroedPagePool::ZeroedPagePool()
+{
+  Memory::get().addReclaimHandler(&reclaimHandler, this);
+}
+
+page_t ZeroedPagePool::getPage()
+{
+  {
+    auto lock = m_lock.getScoped();
+    if (m_count)
+      return m_pages[--m_count];
+  }
+
+  xDeb("Zeroed page pool empty, zeroing a page now");
+
+  const page_t page = Memory::get().getFreePage();
+  zeroPage(page);
+  return page;
+}
+
+page_t ZeroedPagePool::tryGetPage()
+{
+  {
+    auto lock = m_lock.getScoped();
+    if (m_count)
+      return m_pages[--m_count];
+  }
+
+  const page_t page = Memory::get().getFreePages(1);
+  if (page != INVALID_PAGE)
+    zeroPage(page);
+  return page;
+}
+
+bool ZeroedPagePool::refillOne()
+{
+  {
+    auto lock = m_lock.getScoped();
+    if (m_count == Capacity)
+      return false;
+  }
+
+  const page_t page = Memory::get().getFreePages(1);
+  if (page == INVALID_PAGE)
+    return false;
+
+  zeroPage(page);
+
+  auto lock = m_lock.getScoped();
+  // someone may have refilled the pool meanwhile
+  if (m_count == Capacity)
+  {
+    Memory::get().setPageFree(page);
+    return false;
+  }
+  m_pages[m_count++] = page;
+  return true;
+}
+
+std::size_t ZeroedPagePool::reclaim()
+{
+  page_t pages[Capacity];
+  std::size_t count;
+  {
+    auto lock = m_lock.getScoped();
+    count = m_count;
+    std::copy(m_pages, m_pages + count, pages);
+    m_count = 0;
+  }
+
+  if (count)
+    xDeb("Reclaiming %d zeroed pages", count);
+
+  // Memory takes its own lock
+  auto& memory = Memory::get();
+  for (std::size_t i = 0; i < count; ++i)
+    memory.setPageFree(pages[i]);
+
+  return count;
+}
+
+std::size_t ZeroedPagePool::reclaimHandler(void* pool)
+{
+  return static_cast<ZeroedPagePool*>(pool)->reclaim();
+}
+
+std::size_t ZeroedPagePool::getCount()
+{
+  auto lock = m_lock.getScoped();
+  return m_count;
+}
+
+void ZeroedPagePool::zeroPage(page_t page)
+{
+  char* const vaddr =
+    static_cast<char*>(PageDirectory::physToVirt(page * PAGE_SIZE));
+
+  // the page won't be read by us, don't pollute the cache with it
+  uint64_t* ptr = reinterpret_cast<uint64_t*>(vaddr);
+  uint64_t* const end = reinterpret_cast<uint64_t*>(vaddr + PAGE_SIZE);
+  for (; ptr < end; ptr += 4)
+    asm volatile(
+        "movnti %1, (%0)\n"
+        "movnti %1, 8(%0)\n"
+        "movnti %1, 16(%0)\n"
+        "movnti %1, 24(%0)\n"
+        :
+        :"r"(ptr), "r"(0ull)
+        :"memory");
+  // non-temporal stores are weakly ordered
+  asm volatile("sfence":::"memory");
+}
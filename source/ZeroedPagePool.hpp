@@ -0,0 +1,64 @@
+#ifndef ZEROED_PAGE_POOL_HPP
+#define ZEROED_PAGE_POOL_HPP
+
+#include <cstddef>
+
+#include "SpinLock.hpp"
+#include "Types.hpp"
+
+/**
+ * Pool of frames which are already filled with zeros
+ *
+ * The pool is refilled when the CPU is idle, so that pages given to user
+ * space (deferred allocations, ELF segments) don't need to be zeroed on the
+ * fault or exec path.
+ */
+class ZeroedPagePool
+{
+public:
+  static constexpr std::size_t Capacity = 64;
+
+  static ZeroedPagePool& get();
+
+  ZeroedPagePool();
+  ZeroedPagePool(const ZeroedPagePool&) = delete;
+  ZeroedPagePool& operator=(const ZeroedPagePool&) = delete;
+
+  /// Get a zeroed frame, zero one right away if the pool is empty
+  page_t getPage();
+  /** Get a zeroed frame, or INVALID_PAGE if there is no free memory
+   *
+   * Used for speculative allocations which must not exhaust memory.
+   */
+  page_t tryGetPage();
+
+  /** Zero a free frame and put it in the pool
+   *
+   * This is bounded work meant to be called in a loop from the idle task.
+   *
+   * \return false if the pool is full or there is no free frame
+   */
+  bool refillOne();
+
+  /** Give the pooled frames back to Memory
+   *
+   * This is a reclaim handler of Memory, so that zeroed frames are used
+   * before running out of memory.
+   *
+   * \return the number of frames freed
+   */
+  std::size_t reclaim();
+
+  std::size_t getCount();
+
+private:
+  SpinLock m_lock;
+  page_t m_pages[Capacity];
+  std::size_t m_count = 0;
+
+  void zeroPage(page_t page);
+
+  static std::size_t reclaimHandler(void* pool);
+};
+
+#endif /* ZEROED_PAGE_POOL_HPP */
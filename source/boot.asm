@@ -62,7 +62,7 @@ start:
   mov ecx, DWORD [ebx]
   add ecx, ebx
   mov edx, _kernelHeapStart
-  add edx, 8 ; heap block header size + align to 8
+  add edx, 16 ; heap block header size
 .LMBCopyFLoop:
   cmp ebx, ecx
   jge .LMBCopyEnd
@@ -188,7 +188,7 @@ start:
 .LmainStart:
   ; call kmain(multiboot)
 [EXTERN kmain]
-  mov rdi, 0xfffffffff0000008
+  mov rdi, 0xfffffffff0000010
   push QWORD 0x0
   mov rax, kmain
   jmp rax
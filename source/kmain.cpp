@@ -92,24 +92,31 @@ extern "C" [[noreturn]] void kmain(void* mboot)
   xInf("Heap init");
   KHeap::get().init();
 
-  // second we need to prepare the heap which will be used for pagination
+  // then we need to keep track of used pages, the frame map is allocated on
+  // the premapped heap
+  xInf("Memory init");
+  MultibootLoader mbl;
+  mbl.prepareMemory(mboot);
+
+  // we need to prepare the heap which will be used for pagination
   xInf("PageHeap init");
   getPdPageHeap();
 
-  // third we need pagination
+  // finally we need pagination
   xInf("Paging init");
   PageDirectory* pd = PageDirectory::initKernelDirectory();
   pd->use();
 
-  // finally we need to keep track of used pages to be able to get new pages
-  xInf("Memory init");
-  MultibootLoader mbl;
-  mbl.prepareMemory(mboot);
+  xInf("Physmap init");
+  PageDirectory::initPhysmap();
+
+  // now that we can get new pages, small and large allocations can get their
+  // own pages
+  xInf("Paged heaps init");
+  KHeap::get().initPagedHeaps();
 
-  // declare A20 and stuff
-  // TODO: map this in kernel memory, could be useful
-  Memory::get().completeRangeUsed(0xa0000 / 0x1000, 0xb8000 / 0x1000);
-  Memory::get().completeRangeUsed(0xb9000 / 0x1000, 0xe8000 / 0x1000);
+  xInf("Frame database init");
+  Memory::get().initFrameDatabase();
 
   xInf("StackPageHeap init");
   getStackPageHeap();
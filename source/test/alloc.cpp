@@ -2,8 +2,10 @@
 #include "TaskManager.hpp"
 #include "Syscall.hpp"
 #include "KHeap.hpp"
+#include "Memory.hpp"
 #include "Timer.hpp"
 #include "helpers.hpp"
+#include <flix/mman.h>
 
 XLL_LOG_CATEGORY("main");
 
@@ -26,10 +28,266 @@ void simpleMalloc()
   mallocDelete(0x10000);
 }
 
+void slabMalloc()
+{
+  auto& heap = KHeap::get();
+
+  // freed objects must be reused right away
+  void* ptr = heap.kmalloc(24);
+  heap.kfree(ptr);
+  if (heap.kmalloc(24) != ptr)
+    th::fail();
+  heap.kfree(ptr);
+
+  // objects of all classes must not overlap
+  std::vector<char*> ptrs;
+  for (std::size_t size = 1; size <= SlabHeap::MaxSize; size *= 2)
+    for (int i = 0; i < 8; ++i)
+    {
+      char* p = static_cast<char*>(heap.kmalloc(size));
+      memset(p, i, size);
+      ptrs.push_back(p);
+    }
+
+  int i = 0;
+  for (std::size_t size = 1; size <= SlabHeap::MaxSize; size *= 2)
+    for (int n = 0; n < 8; ++n, ++i)
+    {
+      if (ptrs[i][0] != n || ptrs[i][size - 1] != n)
+        th::fail();
+      heap.kfree(ptrs[i]);
+    }
+}
+
+void alignedMalloc()
+{
+  auto& heap = KHeap::get();
+
+  // go through both the slabs and the block heap
+  for (std::size_t align : {16, 64, 4096})
+    for (std::size_t size : {24, 3000, 0x5000})
+    {
+      void* ptr = heap.kmallocAligned(size, align);
+      if (reinterpret_cast<uintptr_t>(ptr) % align)
+        th::fail();
+      memset(ptr, 0, size);
+      // an alignment above the size puts the object in a larger class
+      if (align > size)
+        heap.kfree(ptr);
+      else
+        heap.kfree(ptr, size);
+    }
+
+  for (std::size_t size : {24, 3000, 0x5000})
+    heap.kfree(heap.kmalloc(size), size);
+
+  // cached objects keep the alignment of their type
+  auto& cache = ObjectCache<Task::Context>::get();
+  Task::Context* context = cache.create();
+  if (reinterpret_cast<uintptr_t>(context) % alignof(Task::Context))
+    th::fail();
+  cache.destroy(context);
+}
+
+void atomicMalloc()
+{
+  auto& heap = KHeap::get();
+
+  // make sure there is a free object in the class
+  heap.kfree(heap.kmalloc(24));
+
+  void* ptr;
+  void* bigPtr;
+  {
+    // as if we were in an interrupt handler
+    DisableInterrupts _;
+    ptr = heap.kmallocAtomic(24);
+    bigPtr = heap.kmallocAtomic(SlabHeap::MaxSize * 2);
+    heap.kfree(ptr);
+    heap.kfree(bigPtr);
+  }
+
+  if (!ptr)
+    th::fail();
+  // the block heap is never empty at this point of the tests
+  if (!bigPtr)
+    th::fail();
+}
+
+void objectCache()
+{
+  struct Object
+  {
+    explicit Object(int value)
+      : value(value)
+    {}
+
+    int value;
+    char padding[100];
+  };
+
+  auto& cache = ObjectCache<Object>::get();
+
+  Object* object = cache.create(42);
+  if (object->value != 42)
+    th::fail();
+  cache.destroy(object);
+
+  // the storage must be reused
+  const auto before = cache.getStats();
+  Object* object2 = cache.create(43);
+  if (object2 != object || object2->value != 43)
+    th::fail();
+  const auto after = cache.getStats();
+  cache.destroy(object2);
+
+  if (after.hitCount != before.hitCount + 1 ||
+      after.liveCount != before.liveCount + 1)
+    th::fail();
+}
+
+void blockCoalescing()
+{
+  auto& heap = KHeap::get();
+
+  // stay above the slab sizes so that the block heap is used
+  const std::size_t size = SlabHeap::MaxSize * 2;
+
+  char* ptrs[16];
+  for (auto& ptr : ptrs)
+    ptr = static_cast<char*>(heap.kmalloc(size));
+  const auto before = heap.getStats();
+
+  // free every other block first so that merges happen on both sides
+  for (unsigned i = 0; i < 16; i += 2)
+    heap.kfree(ptrs[i]);
+  for (unsigned i = 1; i < 16; i += 2)
+    heap.kfree(ptrs[i]);
+
+  const auto after = heap.getStats();
+  if (after.freeBlockCount > before.freeBlockCount + 1)
+    th::fail();
+  if (after.largestFreeBlock < 16 * size)
+    th::fail();
+}
+
+void heapShrink()
+{
+  auto& heap = KHeap::get();
+
+  // more than the premapped part of the heap, in blocks small enough not to
+  // go to the large heap
+  void* ptrs[128];
+  for (auto& ptr : ptrs)
+    ptr = heap.kmalloc(LargeHeap::MinSize / 2);
+  const auto grown = heap.getStats();
+  const uint64_t grownPages = Memory::get().getUsedPageCount();
+  for (auto ptr : ptrs)
+    heap.kfree(ptr);
+  const auto shrunk = heap.getStats();
+
+  if (shrunk.heapSize >= grown.heapSize)
+    th::fail();
+  // page tables stay, but the heap pages must have been given back
+  if (Memory::get().getUsedPageCount() + 0x300 > grownPages)
+    th::fail();
+
+  // the slack left after the shrink serves the next allocations without
+  // growing, and freeing them does not shrink again
+  void* ptr = heap.kmalloc(LargeHeap::MinSize / 2);
+  if (heap.getStats().heapSize != shrunk.heapSize)
+    th::fail();
+  heap.kfree(ptr);
+  if (heap.getStats().heapSize != shrunk.heapSize)
+    th::fail();
+}
+
+void largeMalloc()
+{
+  auto& heap = KHeap::get();
+
+  char* ptr = static_cast<char*>(heap.kmalloc(0x100000));
+  if (reinterpret_cast<uintptr_t>(ptr) % PAGE_SIZE)
+    th::fail();
+  memset(ptr, 0, 0x100000);
+  heap.kfree(ptr);
+
+  // freed pages must go back to Memory, page tables may stay
+  const uint64_t usedPages = Memory::get().getUsedPageCount();
+  ptr = static_cast<char*>(heap.kmalloc(0x100000));
+  memset(ptr, 0, 0x100000);
+  heap.kfree(ptr);
+  if (Memory::get().getUsedPageCount() != usedPages)
+    th::fail();
+
+  // neighbour allocations must not overlap
+  char* ptr1 = static_cast<char*>(heap.kmalloc(LargeHeap::MinSize));
+  char* ptr2 = static_cast<char*>(heap.kmalloc(LargeHeap::MinSize));
+  memset(ptr1, 1, LargeHeap::MinSize);
+  memset(ptr2, 2, LargeHeap::MinSize);
+  if (ptr1[LargeHeap::MinSize - 1] != 1 || ptr2[0] != 2)
+    th::fail();
+  heap.kfree(ptr1);
+  heap.kfree(ptr2);
+}
+
+void heapChurn()
+{
+  auto& heap = KHeap::get();
+
+  static constexpr unsigned SLOT_COUNT = 64;
+  char* ptrs[SLOT_COUNT] = {};
+
+  const auto logStats = [&](const char* when) {
+    const auto stats = heap.getStats();
+    xInf("%s: heap %d KiB, used %d KiB, free %d KiB in %d blocks, "
+        "largest %d KiB", when, stats.heapSize / 1024,
+        (stats.heapSize - stats.freeSize) / 1024, stats.freeSize / 1024,
+        stats.freeBlockCount, stats.largestFreeBlock / 1024);
+  };
+
+  logStats("Before churn");
+
+  // pseudo-random sizes and slots so that blocks of different sizes are
+  // freed in a different order than they were allocated
+  uint32_t seed = 1;
+  for (unsigned i = 0; i < 4096; ++i)
+  {
+    seed = seed * 1103515245 + 12345;
+    const unsigned slot = (seed >> 16) % SLOT_COUNT;
+    heap.kfree(ptrs[slot]);
+    ptrs[slot] = static_cast<char*>(
+        heap.kmalloc(SlabHeap::MaxSize + (seed >> 8) % 0x4000));
+  }
+
+  logStats("During churn");
+
+  for (auto ptr : ptrs)
+    heap.kfree(ptr);
+
+  logStats("After churn");
+}
+
 void waitEnd()
 {
   th::runTest("simple_malloc", simpleMalloc);
 
+  th::runTest("slab_malloc", slabMalloc);
+
+  th::runTest("aligned_malloc", alignedMalloc);
+
+  th::runTest("atomic_malloc", atomicMalloc);
+
+  th::runTest("object_cache", objectCache);
+
+  th::runTest("block_coalescing", blockCoalescing);
+
+  th::runTest("heap_shrink", heapShrink);
+
+  th::runTest("large_malloc", largeMalloc);
+
+  th::runTest("heap_churn", heapChurn);
+
   {
     auto loopRun = []{
       for (int i = 0; i < 30; ++i)
@@ -41,7 +299,8 @@ void waitEnd()
 
   th::runTest("mmap_defered",
       []{
-        char* p = (char*)sys::call(sys::mmap, nullptr, 0x10000);
+        char* p = (char*)sys::call(sys::mmap, nullptr, 0x10000,
+            PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS);
         p[0x1005] = 'p';
       });
 
@@ -1,6 +1,7 @@
 #include "Debug.hpp"
 #include "TaskManager.hpp"
 #include "Syscall.hpp"
+#include "ObjectCache.hpp"
 
 namespace th
 {
@@ -8,7 +9,7 @@ namespace th
 void runTask(std::function<void()>* pf)
 {
   auto f = std::move(*pf);
-  delete pf;
+  ObjectCache<std::function<void()>>::get().destroy(pf);
   f();
 }
 
@@ -24,7 +25,8 @@ pid_t startTask(F&& func)
   task.context.rsp = reinterpret_cast<uint64_t>(task.stackTop);
   task.context.rip = reinterpret_cast<uint64_t>(&runTask);
   task.context.rdi = reinterpret_cast<uint64_t>(
-      new std::function<void()>(std::forward<F>(func)));
+      ObjectCache<std::function<void()>>::get().create(
+        std::forward<F>(func)));
   return taskManager->addTask(std::move(task));
 }
 
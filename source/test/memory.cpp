@@ -0,0 +1,524 @@
+#include <cstring>
+#include <vector>
+
+#include "Debug.hpp"
+#include "TaskManager.hpp"
+#include "Syscall.hpp"
+#include "Memory.hpp"
+#include "HierarchicalBitmap.hpp"
+#include "PageDirectory.hpp"
+#include "PageHeap.hpp"
+#include "Symbols.hpp"
+#include "ZeroedPagePool.hpp"
+#include "VmaTree.hpp"
+#include "Cpu.hpp"
+#include "Timer.hpp"
+#include "helpers.hpp"
+
+XLL_LOG_CATEGORY("main");
+
+void bitmapFind()
+{
+  HierarchicalBitmap bitmap;
+  bitmap.init(100000);
+
+  if (bitmap.findFirstSet() != HierarchicalBitmap::npos)
+    th::fail();
+
+  bitmap.set(99999);
+  bitmap.set(70000);
+  if (bitmap.findFirstSet() != 70000)
+    th::fail();
+
+  bitmap.clear(70000);
+  if (bitmap.findFirstSet() != 99999)
+    th::fail();
+
+  bitmap.set(0);
+  if (bitmap.findFirstSet() != 0 || !bitmap.test(0) || bitmap.test(1))
+    th::fail();
+}
+
+void memoryAlloc()
+{
+  auto& memory = Memory::get();
+
+  // the hot frames are handed out first, take them out of the way
+  page_t hotPages[Memory::HotFrameCapacity];
+  const std::size_t hotCount = memory.getHotFrameCount();
+  for (std::size_t i = 0; i < hotCount; ++i)
+    hotPages[i] = memory.getFreePage();
+  if (memory.getHotFrameCount())
+    th::fail();
+
+  const uint64_t usedPages = memory.getUsedPageCount();
+
+  const page_t page = memory.getFreePage();
+  if (memory.getUsedPageCount() != usedPages + 1)
+    th::fail();
+  // give it back to the frame map and not to the hot frames
+  memory.setPagesFree(page, 1);
+
+  // the lowest free frame of the map is always given
+  if (memory.getFreePage() != page)
+    th::fail();
+  memory.setPagesFree(page, 1);
+  if (memory.getFreePages(1) != page)
+    th::fail();
+  memory.setPagesFree(page, 1);
+
+  if (memory.getUsedPageCount() != usedPages)
+    th::fail();
+
+  for (std::size_t i = 0; i < hotCount; ++i)
+    memory.setPageFree(hotPages[i]);
+}
+
+void contiguousAlloc()
+{
+  auto& memory = Memory::get();
+
+  const uint64_t usedPages = memory.getUsedPageCount();
+
+  // a 2MB page and a small aligned range
+  for (auto request : {std::make_pair(512, 512), std::make_pair(3, 16)})
+  {
+    const page_t first = memory.getFreePages(request.first, request.second);
+    if (first == INVALID_PAGE || first % request.second)
+      th::fail();
+    if (memory.getUsedPageCount() != usedPages + request.first)
+      th::fail();
+    memory.setPagesFree(first, request.first);
+  }
+
+  if (memory.getUsedPageCount() != usedPages)
+    th::fail();
+
+  // more than there is
+  if (memory.getFreePages(memory.getFrameCount() + 1) != INVALID_PAGE)
+    th::fail();
+}
+
+void frameRefCount()
+{
+  auto& memory = Memory::get();
+
+  const page_t page = memory.getFreePage();
+  if (memory.getRefCount(page) != 1 || memory.isReserved(page))
+    th::fail();
+
+  memory.refPage(page);
+  memory.unrefPage(page);
+  // still owned once
+  if (memory.getRefCount(page) != 1)
+    th::fail();
+
+  memory.unrefPage(page);
+  if (memory.getRefCount(page) != 0)
+    th::fail();
+
+  // ranges bypass the hot frames, shared frames stay used
+  const page_t first = memory.getFreePages(4);
+  memory.refPage(first + 1);
+  const std::size_t hotCount = memory.getHotFrameCount();
+  const uint64_t used = memory.getUsedPageCount();
+  memory.unrefPages(first, 4);
+  if (memory.getHotFrameCount() != hotCount ||
+      memory.getUsedPageCount() != used - 3)
+    th::fail();
+  if (memory.getRefCount(first) != 0 || memory.getRefCount(first + 1) != 1)
+    th::fail();
+  memory.setPageFree(first + 1);
+
+  // VGA memory is never usable
+  if (!memory.isReserved(0xB8000 / PAGE_SIZE))
+    th::fail();
+}
+
+void hotFrames()
+{
+  auto& memory = Memory::get();
+
+  // the last freed frame is the next one handed out
+  const page_t page = memory.getFreePage();
+  memory.setPageFree(page);
+  if (memory.getFreePage() != page)
+    th::fail();
+  memory.setPageFree(page);
+
+  // overflowing the cache gives frames back to the frame map
+  page_t pages[Memory::HotFrameCapacity * 2];
+  for (auto& p : pages)
+    p = memory.getFreePage();
+  const uint64_t used = memory.getUsedPageCount();
+  for (auto p : pages)
+    memory.setPageFree(p);
+  if (memory.getHotFrameCount() > Memory::HotFrameCapacity)
+    th::fail();
+  if (memory.getUsedPageCount() != used - Memory::HotFrameCapacity * 2)
+    th::fail();
+
+  // contiguous allocations also see the frames kept in the cache
+  const page_t first = memory.getFreePages(Memory::HotFrameCapacity);
+  if (first == INVALID_PAGE)
+    th::fail();
+  memory.setPagesFree(first, Memory::HotFrameCapacity);
+}
+
+void pageHeapCache()
+{
+  auto& heap = getStackPageHeap();
+  auto& memory = Memory::get();
+
+  const auto block = heap.kmalloc();
+  const uint64_t used = memory.getUsedPageCount();
+  heap.kfree(block.first);
+
+  // the block stays mapped and is handed out again
+  if (!heap.getCachedBlockCount() || memory.getUsedPageCount() != used)
+    th::fail();
+  if (heap.kmalloc() != block)
+    th::fail();
+  heap.kfree(block.first);
+
+  const std::size_t reclaimed = heap.reclaim();
+  if (!reclaimed || heap.getCachedBlockCount())
+    th::fail();
+  if (memory.getUsedPageCount() != used - reclaimed)
+    th::fail();
+}
+
+void physmap()
+{
+  auto& memory = Memory::get();
+
+  const page_t page = memory.getFreePage();
+  char* const vaddr =
+    static_cast<char*>(PageDirectory::physToVirt(page * PAGE_SIZE));
+  if (PageDirectory::virtToPhys(vaddr + 0x10) != page * PAGE_SIZE + 0x10)
+    th::fail();
+
+  // write through a regular mapping and read through the physmap
+  char* const mapped = reinterpret_cast<char*>(0x0000100000000000);
+  auto& pd = *PageDirectory::getCurrent();
+  pd.mapPageTo(mapped, page * PAGE_SIZE,
+      PageDirectory::ATTR_RW | PageDirectory::ATTR_PUBLIC);
+  mapped[0x10] = 42;
+  if (vaddr[0x10] != 42)
+    th::fail();
+  pd.unmapPage(mapped);
+
+  memory.setPageFree(page);
+}
+
+void largePages()
+{
+  // the initial kernel heap is a single 2MB page
+  auto& pd = *PageDirectory::getKernelDirectory();
+  char* const heap = Symbols::getHeapBase();
+
+  const auto first = pd.getPhysicalAddress(heap);
+  const auto last = pd.getPhysicalAddress(heap + 0x1ff000);
+  if (!first || !last || *last != *first + 0x1ff000)
+    th::fail();
+  if (*first % PageDirectory::LARGE_PAGE_SIZE)
+    th::fail();
+  if (!pd.isPageMapped(heap + 0x100000))
+    th::fail();
+}
+
+void zeroedPage()
+{
+  auto& pd = *PageDirectory::getCurrent();
+  char* const vaddr = reinterpret_cast<char*>(0x0000100000000000);
+
+  // dirty the pages we free so that they must be zeroed again
+  for (unsigned i = 0; i < ZeroedPagePool::Capacity * 2; ++i)
+  {
+    pd.mapPage(vaddr, PageDirectory::ATTR_RW | PageDirectory::ATTR_ZERO);
+    for (unsigned j = 0; j < PAGE_SIZE; ++j)
+      if (vaddr[j])
+        th::fail();
+    std::memset(vaddr, 0xff, PAGE_SIZE);
+    Memory::get().setPageFree(pd.unmapPage(vaddr) / PAGE_SIZE);
+  }
+
+  // pooled pages are given back when memory runs out
+  auto& pool = ZeroedPagePool::get();
+  auto& memory = Memory::get();
+  while (pool.refillOne())
+    ;
+  const uint64_t used = memory.getUsedPageCount();
+  if (pool.reclaim() != ZeroedPagePool::Capacity || pool.getCount())
+    th::fail();
+  if (memory.getUsedPageCount() != used - ZeroedPagePool::Capacity)
+    th::fail();
+}
+
+void mapRange()
+{
+  auto& pd = *PageDirectory::getCurrent();
+  // crosses a page table boundary, and is large enough for a full flush
+  static constexpr std::size_t PAGE_COUNT =
+    PageDirectory::INVALIDATE_PAGE_THRESHOLD * 2;
+  char* const start =
+    reinterpret_cast<char*>(0x0000100000200000) - 8 * PAGE_SIZE;
+  char* const end = start + PAGE_COUNT * PAGE_SIZE;
+
+  for (unsigned round = 0; round < 2; ++round)
+  {
+    pd.mapRange(start, end,
+        PageDirectory::ATTR_RW | PageDirectory::ATTR_PUBLIC |
+        PageDirectory::ATTR_ZERO);
+    for (char* page = start; page < end; page += PAGE_SIZE)
+    {
+      // a stale TLB entry would show the previous round's frame
+      if (!pd.isPageMapped(page) || *page)
+        th::fail();
+      *page = 1;
+    }
+
+    std::size_t count = 0;
+    pd.unmapRange(start, end, [&](physaddr_t phys) {
+          Memory::get().setPageFree(phys / PAGE_SIZE);
+          ++count;
+        });
+    if (count != PAGE_COUNT)
+      th::fail();
+    if (pd.isPageMapped(start) || pd.isPageMapped(end - PAGE_SIZE))
+      th::fail();
+  }
+}
+
+void pageVisitor()
+{
+  auto& pd = *PageDirectory::getCurrent();
+  char* const near = reinterpret_cast<char*>(0x0000100000000000);
+  // in another PML4 entry
+  char* const far = reinterpret_cast<char*>(0x0000200000000000);
+  static constexpr uint8_t attributes =
+    PageDirectory::ATTR_RW | PageDirectory::ATTR_PUBLIC;
+
+  pd.mapPage(near, attributes);
+  pd.mapPage(near + PAGE_SIZE, attributes);
+  pd.mapPage(far, attributes);
+
+  std::vector<uintptr_t> visited;
+  pd.getManager().forEachEntry(reinterpret_cast<uintptr_t>(near + PAGE_SIZE),
+      reinterpret_cast<uintptr_t>(far + PAGE_SIZE),
+      [&](PageDirectory::PageTableEntry&, uintptr_t address) {
+        visited.push_back(address);
+      });
+  if (visited.size() != 2 ||
+      visited[0] != reinterpret_cast<uintptr_t>(near + PAGE_SIZE) ||
+      visited[1] != reinterpret_cast<uintptr_t>(far))
+    th::fail();
+
+  // the initial heap is a large page, kernel addresses come out canonical
+  char* const heap = Symbols::getHeapBase();
+  bool found = false;
+  PageDirectory::getKernelDirectory()->getManager().forEachEntry(
+      reinterpret_cast<uintptr_t>(heap),
+      reinterpret_cast<uintptr_t>(heap + PAGE_SIZE),
+      [&](PageDirectory::PageTableEntry&, uintptr_t address) {
+        found = address == reinterpret_cast<uintptr_t>(heap);
+      });
+  if (!found)
+    th::fail();
+
+  auto& memory = Memory::get();
+  pd.unmapRange(near, near + 2 * PAGE_SIZE, [&](physaddr_t phys) {
+        memory.setPageFree(phys / PAGE_SIZE);
+      });
+  memory.setPageFree(pd.unmapPage(far) / PAGE_SIZE);
+}
+
+void vmaTree()
+{
+  VmaTree vmas;
+  const uintptr_t base = VmaTree::MMAP_BASE;
+
+  vmas.insert(base, base + 0x3000, PageDirectory::ATTR_RW);
+  if (!vmas.find(base + 0x2fff) || vmas.find(base + 0x3000))
+    th::fail();
+
+  // a hint on a used range is ignored
+  if (vmas.findFree(base, PAGE_SIZE, PAGE_SIZE) != base + 0x3000)
+    th::fail();
+  if (vmas.findFree(base + 0x10000, PAGE_SIZE, PAGE_SIZE) != base + 0x10000)
+    th::fail();
+
+  // hints and lengths which would wrap around are refused
+  if (vmas.findFree(0xfffffffffffff000, 0x2000, PAGE_SIZE) != base + 0x3000)
+    th::fail();
+  if (vmas.findFree(0, ~uintptr_t(0) - 0xfff, PAGE_SIZE))
+    th::fail();
+
+  // removing the middle splits the area
+  std::size_t removed = 0;
+  vmas.remove(base + 0x1000, base + 0x2000,
+      [&](uintptr_t from, uintptr_t to) {
+        if (from != base + 0x1000 || to != base + 0x2000)
+          th::fail();
+        ++removed;
+      });
+  if (removed != 1 || vmas.getCount() != 2)
+    th::fail();
+  if (vmas.find(base + 0x1000) || !vmas.find(base + 0x2000))
+    th::fail();
+  if (vmas.findFree(0, PAGE_SIZE, PAGE_SIZE) != base + 0x1000)
+    th::fail();
+
+  vmas.remove(0, VmaTree::MMAP_END, [](uintptr_t, uintptr_t) {});
+  if (vmas.getCount())
+    th::fail();
+}
+
+void addressSpaceSwitch()
+{
+  auto& memory = Memory::get();
+  auto& pd = *PageDirectory::getCurrent();
+  char* const vaddr = reinterpret_cast<char*>(0x0000100000000000);
+  static constexpr uint8_t attributes =
+    PageDirectory::ATTR_RW | PageDirectory::ATTR_PUBLIC;
+
+  const page_t pages[3] = {
+    memory.getFreePage(), memory.getFreePage(), memory.getFreePage()};
+  for (unsigned i = 0; i < 3; ++i)
+    *static_cast<char*>(PageDirectory::physToVirt(pages[i] * PAGE_SIZE)) =
+      i + 1;
+
+  PageDirectory other;
+  other.mapKernel();
+  pd.mapPageTo(vaddr, pages[0] * PAGE_SIZE, attributes);
+  other.mapPageTo(vaddr, pages[1] * PAGE_SIZE, attributes);
+
+  {
+    // we must not be scheduled out while on the other directory
+    DisableInterrupts di;
+
+    // the TLB must not mix the entries of both directories, whether they are
+    // tagged with a PCID or flushed
+    for (unsigned i = 0; i < 4; ++i)
+    {
+      if (*vaddr != 1)
+        th::fail();
+      other.use();
+      if (*vaddr != 2)
+        th::fail();
+      pd.use();
+    }
+
+    // change the other directory while it is not loaded
+    other.unmapPage(vaddr);
+    other.mapPageTo(vaddr, pages[2] * PAGE_SIZE, attributes);
+    other.use();
+    if (*vaddr != 3)
+      th::fail();
+    other.unmapPage(vaddr);
+    pd.use();
+  }
+
+  pd.unmapPage(vaddr);
+  for (unsigned i = 0; i < 3; ++i)
+    memory.setPageFree(pages[i]);
+}
+
+void frameAllocLatency()
+{
+  static constexpr unsigned ITERATIONS = 1000;
+
+  // from 128MB to 32GB of RAM
+  for (std::size_t frameCount = 1 << 15; frameCount <= 1 << 23;
+      frameCount <<= 2)
+  {
+    HierarchicalBitmap bitmap;
+    bitmap.init(frameCount);
+    // only the last frames are free, which is the worst case for a linear
+    // scan
+    for (std::size_t frame = frameCount - 16; frame < frameCount; ++frame)
+      bitmap.set(frame);
+
+    const uint64_t start = Cpu::rdtsc();
+    for (unsigned i = 0; i < ITERATIONS; ++i)
+    {
+      const std::size_t frame = bitmap.findFirstSet();
+      bitmap.clear(frame);
+      bitmap.set(frame);
+    }
+    const uint64_t cycles = Cpu::rdtsc() - start;
+
+    xInf("%d frames: %d cycles per allocation", frameCount,
+        cycles / ITERATIONS);
+  }
+
+  // and the real thing
+  auto& memory = Memory::get();
+  const uint64_t start = Cpu::rdtsc();
+  for (unsigned i = 0; i < ITERATIONS; ++i)
+    memory.setPageFree(memory.getFreePage());
+  const uint64_t cycles = Cpu::rdtsc() - start;
+
+  xInf("Memory (%d frames): %d cycles per allocation",
+      memory.getFrameCount(), cycles / ITERATIONS);
+}
+
+void waitEnd()
+{
+  th::runTest("bitmap_find", bitmapFind);
+
+  th::runTest("memory_alloc", memoryAlloc);
+
+  th::runTest("contiguous_alloc", contiguousAlloc);
+
+  th::runTest("frame_refcount", frameRefCount);
+
+  th::runTest("hot_frames", hotFrames);
+
+  th::runTest("page_heap_cache", pageHeapCache);
+
+  th::runTest("physmap", physmap);
+
+  th::runTest("large_pages", largePages);
+
+  th::runTest("zeroed_page", zeroedPage);
+
+  th::runTest("map_range", mapRange);
+
+  th::runTest("page_visitor", pageVisitor);
+
+  th::runTest("vma_tree", vmaTree);
+
+  th::runTest("address_space_switch", addressSpaceSwitch);
+
+  th::runTest("frame_alloc_latency", frameAllocLatency);
+
+  th::finish();
+  sys::call(sys::exit);
+}
+
+[[noreturn]] void _main()
+{
+  Timer::init(1000);
+
+  auto& taskManager = *TaskManager::get();
+
+  {
+    Task task = taskManager.newKernelTask();
+    task.stack = static_cast<char*>(getStackPageHeap().kmalloc().first);
+    task.stackTop = task.stack + 0x4000;
+    task.kernelStack = static_cast<char*>(getStackPageHeap().kmalloc().first);
+    task.kernelStackTop = task.kernelStack + 0x4000;
+    task.context.rsp = reinterpret_cast<uint64_t>(task.stackTop);
+    task.context.rip = reinterpret_cast<uint64_t>(&waitEnd);
+    taskManager.addTask(std::move(task));
+  }
+
+  xInf("End of kernel");
+
+  taskManager.scheduleNext(); // start a task, never returns
+
+  // this stack will be reused for interrupts when there is no active task
+
+  PANIC("Reached end of main!");
+}
@@ -2,7 +2,11 @@
 #include "TaskManager.hpp"
 #include "Screen.hpp"
 #include "Syscall.hpp"
+#include "Memory.hpp"
+#include "ZeroedPagePool.hpp"
 #include "helpers.hpp"
+#include <flix/mman.h>
+#include <flix/errno.h>
 
 XLL_LOG_CATEGORY("main");
 
@@ -24,6 +28,116 @@ void forkit()
   sys::call(sys::exit);
 }
 
+static constexpr unsigned SPARSE_PAGE_COUNT = 16;
+volatile bool forkMeasured = false;
+
+void forkSparse()
+{
+  auto& pageHeap = getPdPageHeap();
+  const uint64_t usedBlocks = pageHeap.getUsedBlockCount();
+  const uint64_t usedPages = pageHeap.getUsedPageCount();
+
+  int ret = sys::call(sys::clone, 0, nullptr, nullptr, nullptr, nullptr);
+  if (ret < -1)
+    th::fail();
+  else if (ret == 0)
+  {
+    // keep our page tables alive until they are measured
+    while (!forkMeasured)
+      ;
+  }
+  else
+  {
+    const uint64_t blocks = pageHeap.getUsedBlockCount() - usedBlocks;
+    const uint64_t pages = pageHeap.getUsedPageCount() - usedPages;
+    xInf("Forking %d sparse pages took %d page heap blocks, %d pages",
+        SPARSE_PAGE_COUNT, blocks, pages);
+    // the child needs the 3 upper levels and SPARSE_PAGE_COUNT + 1 page
+    // tables (the pages and the stack), it would take a whole block for each
+    // of them if page tables were not paired
+    if (pages >= (3 + SPARSE_PAGE_COUNT + 1) * PdPageHeap::BlockSize)
+      th::fail();
+    forkMeasured = true;
+    sys::call(sys::wait4, ret, nullptr, 0, nullptr);
+  }
+  sys::call(sys::exit);
+}
+
+void testForkPageTables()
+{
+  auto& taskManager = *TaskManager::get();
+  pid_t tid;
+  {
+    Task task = taskManager.newKernelTask();
+    task.stack = reinterpret_cast<char*>(0x00000000a0000000 - 0x4000);
+    task.stackTop = task.stack + 0x4000;
+    task.pageDirectory.mapRange(task.stack, task.stackTop,
+        PageDirectory::ATTR_RW | PageDirectory::ATTR_PUBLIC);
+    // one page every 2MB, each one needs its own page table
+    for (unsigned i = 0; i < SPARSE_PAGE_COUNT; ++i)
+      task.pageDirectory.mapPage(
+          reinterpret_cast<char*>(0x0000000080000000 + i * 0x200000),
+          PageDirectory::ATTR_RW | PageDirectory::ATTR_PUBLIC);
+    task.kernelStack = static_cast<char*>(getStackPageHeap().kmalloc().first);
+    task.kernelStackTop = task.kernelStack + 0x4000;
+    task.context.rsp = reinterpret_cast<uint64_t>(task.stackTop);
+    task.context.rip = reinterpret_cast<uint64_t>(&forkSparse);
+    tid = taskManager.addTask(std::move(task));
+  }
+  sys::call(sys::wait4, tid, nullptr, 0, nullptr);
+}
+
+volatile int* const cowData = reinterpret_cast<int*>(0x0000000080000000);
+volatile bool parentWrote = false;
+
+void forkCow()
+{
+  *cowData = 1;
+
+  int ret = sys::call(sys::clone, 0, nullptr, nullptr, nullptr, nullptr);
+  if (ret < -1)
+    th::fail();
+  else if (ret == 0)
+  {
+    while (!parentWrote)
+      ;
+    // the parent wrote to its own copy
+    if (*cowData != 1)
+      th::fail();
+    *cowData = 3;
+  }
+  else
+  {
+    *cowData = 2;
+    parentWrote = true;
+    sys::call(sys::wait4, ret, nullptr, 0, nullptr);
+    if (*cowData != 2)
+      th::fail();
+  }
+  sys::call(sys::exit);
+}
+
+void testForkCow()
+{
+  auto& taskManager = *TaskManager::get();
+  pid_t tid;
+  {
+    Task task = taskManager.newKernelTask();
+    task.stack = reinterpret_cast<char*>(0x00000000a0000000 - 0x4000);
+    task.stackTop = task.stack + 0x4000;
+    task.pageDirectory.mapRange(task.stack, task.stackTop,
+        PageDirectory::ATTR_RW | PageDirectory::ATTR_PUBLIC);
+    task.pageDirectory.mapPage(const_cast<int*>(cowData),
+        PageDirectory::ATTR_RW | PageDirectory::ATTR_PUBLIC);
+    task.kernelStack = static_cast<char*>(getStackPageHeap().kmalloc().first);
+    task.kernelStackTop = task.kernelStack + 0x4000;
+    task.context.rsp = reinterpret_cast<uint64_t>(task.stackTop);
+    task.context.rip = reinterpret_cast<uint64_t>(&forkCow);
+    tid = taskManager.addTask(std::move(task));
+  }
+  sys::call(sys::wait4, tid, nullptr, 0, nullptr);
+}
+
 void testfork()
 {
   auto& taskManager = *TaskManager::get();
@@ -57,11 +171,110 @@ void waitEnd()
 
   th::runTestProcesses("mmap",
       []{
-        sys::call(sys::mmap, nullptr, 0x10000);
+        sys::call(sys::mmap, nullptr, 0x10000,
+            PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS);
+      });
+
+  th::runTestProcesses("mmap_unsupported",
+      []{
+        const auto invalid = reinterpret_cast<void*>(-EINVAL);
+        // shared and file mappings do not exist
+        if (sys::call(sys::mmap, nullptr, 0x1000, PROT_READ | PROT_WRITE,
+              MAP_SHARED | MAP_ANONYMOUS) != invalid)
+          th::fail();
+        if (sys::call(sys::mmap, nullptr, 0x1000, PROT_READ | PROT_WRITE,
+              MAP_PRIVATE) != invalid)
+          th::fail();
+        if (sys::call(sys::munmap, nullptr, 0) != -EINVAL)
+          th::fail();
+      });
+
+  th::runTestProcesses("mmap_fault_around",
+      []{
+        static constexpr std::size_t pageCount = 64;
+        volatile char* p = (char*)sys::call(sys::mmap, nullptr,
+            pageCount * 0x1000, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS);
+        const uint64_t faults = PageDirectory::getDeferredFaultCount();
+        for (std::size_t page = 0; page < pageCount; ++page)
+        {
+          if (p[page * 0x1000])
+            th::fail();
+          p[page * 0x1000] = 1;
+        }
+        // one fault per window, plus one if the region is not aligned on it
+        const uint64_t taken = PageDirectory::getDeferredFaultCount() - faults;
+        xInf("Touching %d pages took %d faults", pageCount, taken);
+        if (taken > pageCount / PageDirectory::FAULT_AROUND_PAGES + 1)
+          th::fail();
+      });
+
+  th::runTestProcesses("mmap_populate",
+      []{
+        static constexpr std::size_t size = 0x210000;
+        volatile char* p = (char*)sys::call(sys::mmap, nullptr, size,
+            PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE);
+        const uint64_t faults = PageDirectory::getDeferredFaultCount();
+        for (std::size_t offset = 0; offset < size; offset += 0x1000)
+          if (p[offset])
+            th::fail();
+        if (PageDirectory::getDeferredFaultCount() != faults)
+          th::fail();
+      });
+
+  th::runTestProcesses("mmap_large",
+      []{
+        static constexpr std::size_t size = 0x400000;
+        // backed by two large pages, zeroed on first touch
+        volatile char* p = (char*)sys::call(sys::mmap, nullptr, size,
+            PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS);
+        for (std::size_t offset = 0; offset < size; offset += 0x1000)
+        {
+          if (p[offset])
+            th::fail();
+          p[offset] = 1;
+        }
+      });
+
+  th::runTestProcesses("munmap",
+      []{
+        static constexpr std::size_t size = 0x220000;
+        auto& memory = Memory::get();
+
+        char* p = (char*)sys::call(sys::mmap, nullptr, size,
+            PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS);
+        const uint64_t usedPages = memory.getUsedPageCount();
+        for (std::size_t offset = 0; offset < size; offset += 0x1000)
+          p[offset] = 1;
+
+        // cut a hole in the large page, then release everything
+        if (sys::call(sys::munmap, p + 0x1000, 0x1000))
+          th::fail();
+        if (sys::call(sys::munmap, p, size))
+          th::fail();
+        // the zeroed page pool and the page heap may have kept a few frames,
+        // but not the ones of the region
+        if (memory.getUsedPageCount() >
+            usedPages + ZeroedPagePool::Capacity + PdPageHeap::BlockSize)
+          th::fail();
+
+        // the address space is recycled, hints are honoured when free
+        char* q = (char*)sys::call(sys::mmap, p, size,
+            PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS);
+        if (q != p)
+          th::fail();
+        if (q[0x1000])
+          th::fail();
+        sys::call(sys::munmap, q, size);
       });
 
   th::runTest("fork", testfork);
 
+  th::runTest("fork_page_tables", testForkPageTables);
+
+  th::runTest("fork_cow", testForkCow);
+
   th::finish();
   sys::call(sys::exit);
 }